@@ -2,71 +2,43 @@
 This script exports the Llama 2 weights in llama2c.bin format.
 """
 import sys
-import struct
 from pathlib import Path
 import json
 
 import torch
 
-from model import precompute_freqs_cis
+from model import write_checkpoint
 
 
-def export(p, state_dict, filepath='model.bin'):
-    """export the model weights in fp32 into .bin file to be read from C"""
-    f = open(filepath, 'wb')
-
-    def serialize(key):
-        print(f"writing {key}...")
-        t = state_dict[key].contiguous().view(-1).type(torch.float32).numpy()
-        f.write(memoryview(t))
-        del state_dict[key]
-
-    # first write out the header
+def export(p, state_dict, filepath='model.bin', group_size=None, half=None):
+    """export the model weights into a version 3 .bin file to be read from C, in fp32
+    or, with a group_size, with the matmul weights quantized to int8 (Q8_0), or with
+    half 'fp16' or 'bf16' stored in 16 bits"""
     hidden_dim = state_dict['layers.0.feed_forward.w1.weight'].shape[0]
     p['vocab_size'] = 32000
     p['max_seq_len'] = 2048
-
     n_kv_heads = p.get('n_kv_heads') or p['n_heads']
-    header = struct.pack(
-        'iiiiiii',
-        p['dim'], hidden_dim, p['n_layers'], p['n_heads'],
-        n_kv_heads, -p['vocab_size'], p['max_seq_len']
-    )
-    # NOTE ABOVE: -ve vocab_size is indicating that the classifier weights are present
-    # in the checkpoint and should be loaded.
-    f.write(header)
-
-    # next write out the embedding weights
-    print("writing tok_embeddings...")
-    serialize('tok_embeddings.weight')
-
-    # now all the layers
-    # attention weights
-    for i in range(p['n_layers']): serialize(f'layers.{i}.attention_norm.weight')
-    for i in range(p['n_layers']): serialize(f'layers.{i}.attention.wq.weight')
-    for i in range(p['n_layers']): serialize(f'layers.{i}.attention.wk.weight')
-    for i in range(p['n_layers']): serialize(f'layers.{i}.attention.wv.weight')
-    for i in range(p['n_layers']): serialize(f'layers.{i}.attention.wo.weight')
-    # ffn weights
-    for i in range(p['n_layers']): serialize(f'layers.{i}.ffn_norm.weight')
-    for i in range(p['n_layers']): serialize(f'layers.{i}.feed_forward.w1.weight')
-    for i in range(p['n_layers']): serialize(f'layers.{i}.feed_forward.w2.weight')
-    for i in range(p['n_layers']): serialize(f'layers.{i}.feed_forward.w3.weight')
-
-    # final rmsnorm
-    serialize('norm.weight')
-    # freqs_cis
-    freqs_cis = precompute_freqs_cis(p['dim'] // p['n_heads'], p['max_seq_len'] * 2)
-    state_dict['freqs_cis.real'] = freqs_cis.real[:p['max_seq_len']]
-    state_dict['freqs_cis.imag'] = freqs_cis.imag[:p['max_seq_len']]
-    serialize('freqs_cis.real')
-    serialize('freqs_cis.imag')
-
-    # finally write the output weights
-    serialize('output.weight')
-
-    f.close()
-    print(f"wrote {filepath}")
+    header = (p['dim'], hidden_dim, p['n_layers'], p['n_heads'],
+              n_kv_heads, p['vocab_size'], p['max_seq_len'])
+    layers = range(p['n_layers'])
+    tensors = {
+        'tok_embeddings': [state_dict['tok_embeddings.weight']],
+        'attention_norm': [state_dict[f'layers.{i}.attention_norm.weight'] for i in layers],
+        'ffn_norm': [state_dict[f'layers.{i}.ffn_norm.weight'] for i in layers],
+        'norm': [state_dict['norm.weight']],
+        # Meta's models don't share the classifier with the embeddings
+        'output': [state_dict['output.weight']],
+    }
+    for name in ['attention.wq', 'attention.wk', 'attention.wv', 'attention.wo',
+                 'feed_forward.w1', 'feed_forward.w2', 'feed_forward.w3']:
+        tensors[name.split('.')[1]] = [state_dict[f'layers.{i}.{name}.weight'] for i in layers]
+    # freqs_cis are recomputed by run.c, so they are not written
+    write_checkpoint(filepath, header, False, tensors, group_size, half)
+
+
+def export_q80(p, state_dict, filepath='model_q80.bin', group_size=64):
+    """export the model weights quantized to int8 (Q8_0) into a version 3 .bin file"""
+    export(p, state_dict, filepath, group_size)
 
 
 def concat_weights(models):
@@ -88,7 +60,7 @@ def concat_weights(models):
     return state_dict
 
 
-def load_and_export(model_path, output_path):
+def load_and_export(model_path, output_path, q80=False, half=None):
     with open(model_path + 'params.json') as f:
         params = json.load(f)
         print(params)
@@ -101,14 +73,19 @@ def load_and_export(model_path, output_path):
 
     state_dict = concat_weights(models)
     del models
-    export(params, state_dict, output_path)
+    if q80:
+        export_q80(params, state_dict, output_path)
+    else:
+        export(params, state_dict, output_path, half=half)
 
 
 if __name__ == '__main__':
     if len(sys.argv) == 1:
-        print('[Llama model folder path] [output path]')
+        print('[Llama model folder path] [output path] [--q80 | --fp16 | --bf16]')
         exit()
 
     model_path = sys.argv[1]
     output_path = sys.argv[2]
-    load_and_export(model_path, output_path)
+    q80 = '--q80' in sys.argv[3:]
+    half = 'fp16' if '--fp16' in sys.argv[3:] else 'bf16' if '--bf16' in sys.argv[3:] else None
+    load_and_export(model_path, output_path, q80, half)
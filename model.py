@@ -4,7 +4,6 @@ import inspect
 from dataclasses import dataclass
 from typing import Any, Optional, Tuple
 
-import numpy as np
 import torch
 import torch.nn.functional as F
 from torch import nn
@@ -22,6 +21,89 @@ class ModelArgs:
     dropout: float = 0.0
 
 
+def quantize_q80(w, group_size):
+    """
+    takes a tensor and returns the Q8_0 quantized version
+    i.e. symmetric quantization into int8, range [-127,127], one fp32 scale per group
+    """
+    assert w.numel() % group_size == 0
+    w = w.float().reshape(-1, group_size)
+    # find the max in each group, and the scale that maps it to 127
+    wmax = torch.abs(w).max(dim=1).values
+    scale = wmax / 127.0
+    quant = w / torch.where(scale > 0, scale, torch.ones_like(scale))[:, None]
+    int8val = torch.round(quant).to(torch.int8)
+    # dequantize, to report the max error
+    fp32val = (int8val.float() * scale[:, None]).view(-1)
+    err = torch.abs(fp32val - w.view(-1)).max().item()
+    return int8val, scale, err
+
+# the tensors of a version 3 .bin file, in the order of its offset table (and of run.c's TensorId)
+CHECKPOINT_TENSORS = ['tok_embeddings', 'attention_norm', 'ffn_norm', 'wq', 'wk', 'wv', 'wo',
+                      'w1', 'w2', 'w3', 'norm', 'freqs_cos', 'freqs_sin', 'output']
+QUANTIZED_TENSORS = {'tok_embeddings', 'wq', 'wk', 'wv', 'wo', 'w1', 'w2', 'w3', 'output'}
+
+def write_checkpoint(filepath, header, shared_classifier, tensors, group_size=None, half=None):
+    """
+    export a version 3 .bin file to be read from C: a 64 byte header, a table with the
+    byte offset of every tensor, then the tensors, each aligned to 64 bytes. header is
+    (dim, hidden_dim, n_layers, n_heads, n_kv_heads, vocab_size, max_seq_len). tensors
+    maps the names in CHECKPOINT_TENSORS to lists of per-layer tensors, each written as
+    one flat array over all its layers; missing names are left out of the file (freqs_cos
+    and freqs_sin are then computed by run.c, output shares tok_embeddings). with a
+    group_size the QUANTIZED_TENSORS are quantized to int8 (Q8_0) in groups, written as
+    all the int8 values of all their layers followed by all their scales. with half
+    'fp16' or 'bf16' they are rounded to that instead, and have no scales
+    """
+    assert half in (None, 'fp16', 'bf16') and (half is None or group_size is None)
+    if group_size is not None:
+        dim, hidden_dim = header[0], header[1]
+        # groups must not straddle the rows of any matmul
+        while dim % group_size != 0 or hidden_dim % group_size != 0:
+            group_size //= 2
+            print(f"BACKOFF: reducing group size to {group_size} to fit dim and hidden_dim")
+    f = open(filepath, 'wb')
+    # the header and the table are written last, once the offsets are known
+    f.write(b'\0' * (64 + 16 * len(CHECKPOINT_TENSORS)))
+
+    def write(ts):
+        f.write(b'\0' * (-f.tell() % 64)) # align
+        offset = f.tell()
+        for t in ts:
+            f.write(memoryview(t.contiguous().view(-1).numpy()))
+        return offset
+
+    table = []
+    for name in CHECKPOINT_TENSORS:
+        layers = [t.detach().cpu() for t in tensors.get(name, [])]
+        if not layers:
+            table.append((0, 0))
+        elif group_size is not None and name in QUANTIZED_TENSORS:
+            qs, ss, errs = zip(*[quantize_q80(t, group_size) for t in layers])
+            table.append((write(qs), write(ss)))
+            print(f"quantized {len(layers)} x {tuple(layers[0].shape)}, max error {max(errs)}")
+        elif half is not None and name in QUANTIZED_TENSORS:
+            # bf16 has no numpy dtype, its bits go out as int16
+            hs = [t.half() if half == 'fp16' else t.bfloat16().view(torch.int16) for t in layers]
+            table.append((write(hs), 0))
+        else:
+            table.append((write([t.float() for t in layers]), 0))
+    f.seek(0)
+    f.write(struct.pack('I', 0x616b3432)) # magic, "ak42" in ASCII
+    f.write(struct.pack('i', 3)) # version
+    f.write(struct.pack('iiiiiii', *header))
+    dtype = 1 if group_size is not None else {None: 0, 'fp16': 2, 'bf16': 3}[half]
+    f.write(struct.pack('I', dtype)) # dtype, fp32, Q8_0, fp16 or bf16
+    f.write(struct.pack('I', int(shared_classifier))) # flags
+    f.write(struct.pack('i', group_size or 0))
+    f.write(struct.pack('i', len(table)))
+    f.seek(64)
+    for offset, scales in table:
+        f.write(struct.pack('QQ', offset, scales))
+    f.close()
+    print(f"wrote {filepath}")
+
+
 class RMSNorm(torch.nn.Module):
     def __init__(self, dim: int, eps: float):
         super().__init__()
@@ -314,54 +396,32 @@ class Transformer(nn.Module):
             
         return idx
 
-    def export(self, filepath='model.bin'):
-        """export the model weights in fp32 into .bin file to be read from C"""
-        f = open(filepath, 'wb')
-
-        def serialize(t):
-            d = t.detach().cpu().view(-1).numpy().astype(np.float32)
-            b = struct.pack(f'{len(d)}f', *d)
-            f.write(b)
-
-        # first write out the header
-        hidden_dim = self.layers[0].feed_forward.w1.weight.shape[0]
+    def export(self, filepath='model.bin', group_size=None, half=None):
+        """export the model weights into a version 3 .bin file to be read from C, in fp32
+        or, with a group_size, with the matmul weights quantized to int8 (Q8_0), or with
+        half 'fp16' or 'bf16' stored in 16 bits"""
         p = self.params
+        hidden_dim = self.layers[0].feed_forward.w1.weight.shape[0]
         n_kv_heads = p.n_heads if p.n_kv_heads is None else p.n_kv_heads
-        header = struct.pack('iiiiiii', p.dim, hidden_dim, p.n_layers, p.n_heads, 
-                                       n_kv_heads, p.vocab_size, p.max_seq_len)
-        f.write(header)
-
-        # next write out the embedding weights
-        serialize(self.tok_embeddings.weight)
-        
-        # now all the layers
-        # attention weights
-        for layer in self.layers:
-            serialize(layer.attention_norm.weight)
-        for layer in self.layers:
-            serialize(layer.attention.wq.weight)
-        for layer in self.layers:
-            serialize(layer.attention.wk.weight)
-        for layer in self.layers:
-            serialize(layer.attention.wv.weight)
-        for layer in self.layers:
-            serialize(layer.attention.wo.weight)
-        # ffn weights
-        for layer in self.layers:
-            serialize(layer.ffn_norm.weight)
-        for layer in self.layers:
-            serialize(layer.feed_forward.w1.weight)
-        for layer in self.layers:
-            serialize(layer.feed_forward.w2.weight)
-        for layer in self.layers:
-            serialize(layer.feed_forward.w3.weight)
-        # final rmsnorm
-        serialize(self.norm.weight)
-        # note: no need to write final classifier weights due to weight sharing
-        # freqs_cis
-        serialize(self.freqs_cis.real[:p.max_seq_len])
-        serialize(self.freqs_cis.imag[:p.max_seq_len])
-
-        # write to binary file
-        f.close()
-        print(f"wrote {filepath}")
+        header = (p.dim, hidden_dim, p.n_layers, p.n_heads, n_kv_heads, p.vocab_size, p.max_seq_len)
+        tensors = {
+            'tok_embeddings': [self.tok_embeddings.weight],
+            'attention_norm': [l.attention_norm.weight for l in self.layers],
+            'ffn_norm': [l.ffn_norm.weight for l in self.layers],
+            'norm': [self.norm.weight],
+        }
+        for name in ['wq', 'wk', 'wv', 'wo']:
+            tensors[name] = [getattr(l.attention, name).weight for l in self.layers]
+        for name in ['w1', 'w2', 'w3']:
+            tensors[name] = [getattr(l.feed_forward, name).weight for l in self.layers]
+        # the classifier shares the token embeddings, and freqs_cis are recomputed by run.c,
+        # so neither is written
+        write_checkpoint(filepath, header, True, tensors, group_size, half)
+
+    def export_q80(self, filepath='model_q80.bin', group_size=64):
+        """export the model weights quantized to int8 (Q8_0) into a version 3 .bin file"""
+        self.export(filepath, group_size)
+
+    def export_half(self, filepath='model_bf16.bin', half='bf16'):
+        """export the model weights with the matmul weights in fp16 or bf16 into a version 3 .bin file"""
+        self.export(filepath, half=half)
@@ -8,16 +8,50 @@ Then run with:
 $ ./run
 */
 
+#define _GNU_SOURCE // for pinning threads to cpus
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <time.h>
 #include <math.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <glob.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#define HUGETLBFS_MAGIC 0x958458f6
+#define MPOL_BIND 2       // from linux/mempolicy.h, so that --numa needs no libnuma
+#define MPOL_INTERLEAVE 3
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define memcpy __builtin_memcpy
+
+// versioned checkpoints start with this magic number, "ak42" in ASCII
+#define CHECKPOINT_MAGIC 0x616b3432
+// max number of tokens forwarded together in one pass: a chunk of prompt tokens
+// being prefilled, or the current tokens of all sequences in a batched decode step
+#define MAX_CHUNK 16
+// number of positions per block of the paged kv cache
+#define KV_BLOCK 16
+// max rank of the low-rank adapters
+#define MAX_LORA_RANK 64
 // ----------------------------------------------------------------------------
 // Transformer and RunState structs, and related memory management
 
@@ -39,8 +73,8 @@ typedef struct {
     float*  __restrict__ rms_ffn_weight; // (layer, dim)
     // weights for matmuls
     float* __restrict__  wq; // (layer, dim, dim)
-    float*  __restrict__ wk; // (layer, dim, dim)
-    float*  __restrict__ wv; // (layer, dim, dim)
+    float*  __restrict__ wk; // (layer, kv_dim, dim)
+    float*  __restrict__ wv; // (layer, kv_dim, dim)
     float*  __restrict__ wo; // (layer, dim, dim)
     // weights for ffn
     float*  __restrict__ w1; // (layer, hidden_dim, dim)
@@ -56,60 +90,198 @@ typedef struct {
 } TransformerWeights;
 
 typedef struct {
-    // current wave of activations
-    float * __restrict__ x; // activation at current time stamp (dim,)
-    float * __restrict__ xb; // same, but inside a residual branch (dim,)
-    float * __restrict__ xb2; // an additional buffer just for convenience (dim,)
-    float * __restrict__ hb; // buffer for hidden dimension in the ffn (hidden_dim,)
-    float * __restrict__ hb2; // buffer for hidden dimension in the ffn (hidden_dim,)
-    float * __restrict__ q; // query (dim,)
-    float * __restrict__ k; // key (dim,)
-    float * __restrict__ v; // value (dim,)
-    float * __restrict__ att; // buffer for scores/attention values (n_heads, seq_len)
-    float * __restrict__ logits; // output logits
-    // kv cache
-    float*  __restrict__ key_cache;   // (layer, seq_len, dim)
-    float*  __restrict__ value_cache; // (layer, seq_len, dim)
+    int8_t* q; // quantized values
+    float* s; // scaling factors, one per group of group_size values
+    uint16_t* h; // or, for fp16 and bf16 weights, the 16-bit values, with q and s NULL
+} QuantizedTensor;
+
+typedef struct {
+    // same tensors as TransformerWeights, but the matmul weights and the token
+    // embeddings are int8 quantized in groups (Q8_0), or stored as fp16 or bf16,
+    // the rmsnorm weights stay fp32. per-layer tensors are one flat array over all layers
+    int dtype; // DTYPE_Q8_0, DTYPE_F16 or DTYPE_BF16
+    int group_size; // of Q8_0
+    QuantizedTensor token_embedding_table; // (vocab_size, dim)
+    float* rms_att_weight; // (layer, dim)
+    float* rms_ffn_weight; // (layer, dim)
+    QuantizedTensor wq; // (layer, dim, dim)
+    QuantizedTensor wk; // (layer, kv_dim, dim)
+    QuantizedTensor wv; // (layer, kv_dim, dim)
+    QuantizedTensor wo; // (layer, dim, dim)
+    QuantizedTensor w1; // (layer, hidden_dim, dim)
+    QuantizedTensor w2; // (layer, dim, hidden_dim)
+    QuantizedTensor w3; // (layer, hidden_dim, dim)
+    float* rms_final_weight; // (dim,)
+    // not stored in the file, computed at load time
+    float* freq_cis_real; // (seq_len, head_size/2)
+    float* freq_cis_imag; // (seq_len, head_size/2)
+    QuantizedTensor wcls; // (vocab_size, dim)
+} QuantizedWeights;
+
+typedef struct {
+    // low-rank adapters (LoRA) on top of the frozen weights: an adapted matmul W (d, n) computes
+    // W x + scale * B (A x), with A (layer, rank, n) and B (layer, d, rank). rank 0: no adapters
+    int rank;
+    float alpha; // scale = alpha / rank
+    float scale;
+    int ffn; // 1 if w1, w2 and w3 are adapted too, not only the attention matmuls
+    float* wq_a; // (layer, rank, dim)
+    float* wq_b; // (layer, dim, rank)
+    float* wk_a; // (layer, rank, dim)
+    float* wk_b; // (layer, kv_dim, rank)
+    float* wv_a; // (layer, rank, dim)
+    float* wv_b; // (layer, kv_dim, rank)
+    float* wo_a; // (layer, rank, dim)
+    float* wo_b; // (layer, dim, rank)
+    float* w1_a; // (layer, rank, dim)
+    float* w1_b; // (layer, hidden_dim, rank)
+    float* w2_a; // (layer, rank, hidden_dim)
+    float* w2_b; // (layer, dim, rank)
+    float* w3_a; // (layer, rank, dim)
+    float* w3_b; // (layer, hidden_dim, rank)
+} LoraWeights;
+
+// version 3 checkpoints: this header padded to 64 bytes, then a table of n_tensors entries
+// with the byte offset of every tensor from the start of the file, then the tensors, each
+// 64-byte aligned. int8 tensors also have the offset of their scales (fp16 and bf16 ones have
+// none), and absent tensors (the classifier when shared, freq_cis, which are computed at load)
+// have offset 0
+#define CHECKPOINT_ALIGN 64
+#define CHECKPOINT_SHARED_CLASSIFIER 1 // flags
+typedef enum { DTYPE_FP32, DTYPE_Q8_0, DTYPE_F16, DTYPE_BF16 } CheckpointDtype; // of the matmul weights and embeddings
+char* dtype_names[] = { "fp32", "q8_0", "fp16", "bf16" };
+
+typedef struct {
+    uint32_t magic;
+    int version;
+    Config config;
+    uint32_t dtype;
+    uint32_t flags;
+    int group_size; // of the int8 tensors
+    int n_tensors;
+} CheckpointHeader;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t scales;
+} TensorEntry;
+
+// the tensors in the order of the table, the same as in TransformerWeights
+typedef enum {
+    TENSOR_TOKEN_EMBEDDING, TENSOR_RMS_ATT, TENSOR_RMS_FFN, TENSOR_WQ, TENSOR_WK, TENSOR_WV, TENSOR_WO,
+    TENSOR_W1, TENSOR_W2, TENSOR_W3, TENSOR_RMS_FINAL, TENSOR_FREQ_CIS_REAL, TENSOR_FREQ_CIS_IMAG,
+    TENSOR_WCLS, N_TENSORS
+} TensorId;
+
+typedef struct {
+    // current wave of activations, one row per token being forwarded
+    float * __restrict__ x; // activation at current time stamp (MAX_CHUNK, dim)
+    float * __restrict__ xb; // same, but inside a residual branch (MAX_CHUNK, dim)
+    float * __restrict__ xb2; // an additional buffer just for convenience (MAX_CHUNK, dim)
+    float * __restrict__ hb; // buffer for hidden dimension in the ffn (MAX_CHUNK, hidden_dim)
+    float * __restrict__ q; // query (MAX_CHUNK, dim)
+    float * __restrict__ k; // key (MAX_CHUNK, kv_dim)
+    float * __restrict__ v; // value (MAX_CHUNK, kv_dim)
+    float * __restrict__ att; // buffer for scores/attention values (MAX_CHUNK, n_heads, seq_len)
+    float * __restrict__ logits; // output logits (MAX_CHUNK, vocab_size), see transformer_rows
+    float * __restrict__ lora_h; // A x of up to two adapters at once (2, MAX_CHUNK, MAX_LORA_RANK)
+    // quantized activations, only used with int8 weights
+    int8_t* xq; // (MAX_CHUNK, max(dim, hidden_dim))
+    float* xq_s; // its scaling factors
+    // kv cache, a pool of blocks of KV_BLOCK positions each. there is one slot per sequence that
+    // can be decoded concurrently, and the keys/values at position pos of the sequence in slot i
+    // are in block block_table[i * max_blocks + pos / KV_BLOCK]
+    int n_slots;
+    int n_blocks;
+    int max_blocks; // blocks needed for seq_len positions
+    int* block_table; // (n_slots, max_blocks), -1 where no block is assigned
+    size_t kv_bytes; // size of each of the two pools below
+    int kv_dtype; // DTYPE_FP32, or DTYPE_F16 or DTYPE_BF16 for a 16-bit kv cache, only for forward_rows
+    void*  __restrict__ key_cache;   // (n_blocks, layer, n_kv_heads, KV_BLOCK, head_size)
+    void*  __restrict__ value_cache; // (n_blocks, layer, n_kv_heads, KV_BLOCK, head_size)
+    // ring kv cache, for generating past seq_len (see kv_position). ring_len 0: no ring
+    int ring_len; // positions kept per sequence, seq_len
+    int n_sink;   // the first n_sink positions stay pinned, the attention sinks
+    int ring_end; // the last position of the chunk being forwarded, set by forward_rows
+    double* rope_freq; // (head_size/2,) RoPE angle per position, for positions past the tables
+    float* rope_rows; // (MAX_CHUNK, head_size) cos then sin for each row past the tables
+    float* q_sink; // (MAX_CHUNK, dim) each query rotated as if at the end of the ring, for the sinks
 } RunState;
 
-void malloc_run_state(RunState* s, Config* p) {
+size_t kv_value_size(int kv_dtype) {
+    return kv_dtype == DTYPE_FP32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+void malloc_run_state(RunState* s, Config* p, int n_slots, int n_blocks, int kv_dtype) {
+    // with n_blocks 0, every slot owns the blocks for all seq_len positions up front.
+    // otherwise the block tables start empty and blocks are handed out by a KVAllocator.
+    // the kv cache holds kv_dtype values, 16-bit ones only work with forward_rows
     // we calloc instead of malloc to keep valgrind happy
-    s->x = calloc(p->dim, sizeof(float));
-    s->xb = calloc(p->dim, sizeof(float));
-    s->xb2 = calloc(p->dim, sizeof(float));
-    s->hb = calloc(p->hidden_dim, sizeof(float));
-    s->hb2 = calloc(p->hidden_dim, sizeof(float));
-    s->q = calloc(p->dim, sizeof(float));
-    s->k = calloc(p->dim, sizeof(float));
-    s->v = calloc(p->dim, sizeof(float));
-    s->att = calloc(p->n_heads * p->seq_len, sizeof(float));
-    s->logits = calloc(p->vocab_size, sizeof(float));
-    s->key_cache = calloc(p->n_layers * p->seq_len * p->dim, sizeof(float));
-    s->value_cache = calloc(p->n_layers * p->seq_len * p->dim, sizeof(float));
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    s->x = calloc(MAX_CHUNK * p->dim, sizeof(float));
+    s->xb = calloc(MAX_CHUNK * p->dim, sizeof(float));
+    s->xb2 = calloc(MAX_CHUNK * p->dim, sizeof(float));
+    s->hb = calloc(MAX_CHUNK * p->hidden_dim, sizeof(float));
+    s->q = calloc(MAX_CHUNK * p->dim, sizeof(float));
+    s->k = calloc(MAX_CHUNK * kv_dim, sizeof(float));
+    s->v = calloc(MAX_CHUNK * kv_dim, sizeof(float));
+    s->att = calloc(MAX_CHUNK * p->n_heads * p->seq_len, sizeof(float));
+    s->logits = calloc(MAX_CHUNK * p->vocab_size, sizeof(float));
+    s->lora_h = calloc(2 * MAX_CHUNK * MAX_LORA_RANK, sizeof(float));
+    s->ring_len = 0;
+    s->n_sink = 0;
+    s->ring_end = 0;
+    s->rope_freq = NULL;
+    s->rope_rows = calloc(MAX_CHUNK * (p->dim / p->n_heads), sizeof(float));
+    s->q_sink = calloc(MAX_CHUNK * p->dim, sizeof(float));
+    int xq_size = MAX_CHUNK * (p->dim > p->hidden_dim ? p->dim : p->hidden_dim);
+    s->xq = calloc(xq_size, sizeof(int8_t));
+    s->xq_s = calloc(xq_size, sizeof(float)); // enough for any group size
+    s->n_slots = n_slots;
+    s->max_blocks = (p->seq_len + KV_BLOCK - 1) / KV_BLOCK;
+    s->n_blocks = n_blocks > 0 ? n_blocks : n_slots * s->max_blocks;
+    s->block_table = malloc(n_slots * s->max_blocks * sizeof(int));
+    size_t block_size = (size_t)p->n_layers * KV_BLOCK * kv_dim;
+    // the kv pools are mapped instead of calloc'd so that they are page aligned,
+    // and restore_run_state can map a snapshot into them in place
+    s->kv_dtype = kv_dtype;
+    s->kv_bytes = s->n_blocks * block_size * kv_value_size(kv_dtype);
+    s->key_cache = mmap(NULL, s->kv_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    s->value_cache = mmap(NULL, s->kv_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (s->key_cache == MAP_FAILED) { s->key_cache = NULL; }
+    if (s->value_cache == MAP_FAILED) { s->value_cache = NULL; }
     // ensure all mallocs went fine
-    if (!s->x || !s->xb || !s->xb2 || !s->hb || !s->hb2 || !s->q 
-     || !s->k || !s->v || !s->att || !s->logits || !s->key_cache 
-     || !s->value_cache) {
+    if (!s->x || !s->xb || !s->xb2 || !s->hb || !s->q 
+     || !s->k || !s->v || !s->att || !s->logits || !s->lora_h || !s->key_cache 
+     || !s->value_cache || !s->xq || !s->xq_s || !s->block_table || !s->rope_rows || !s->q_sink) {
         printf("malloc failed!\n");
         exit(1);
     }
+    for (int i = 0; i < n_slots * s->max_blocks; i++) {
+        s->block_table[i] = n_blocks > 0 ? -1 : i;
+    }
 }
 
 
+void zero_activations(RunState* s, Config* p) {
+    // everything but the kv cache, a few MAX_CHUNK rows each
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    memset(s->x, 0, MAX_CHUNK * p->dim * sizeof(float));
+    memset(s->xb, 0, MAX_CHUNK * p->dim * sizeof(float));
+    memset(s->xb2, 0, MAX_CHUNK * p->dim * sizeof(float));
+    memset(s->hb, 0, MAX_CHUNK * p->hidden_dim * sizeof(float));
+    memset(s->q, 0, MAX_CHUNK * p->dim * sizeof(float));
+    memset(s->k, 0, MAX_CHUNK * kv_dim * sizeof(float));
+    memset(s->v, 0, MAX_CHUNK * kv_dim * sizeof(float));
+    memset(s->att, 0, MAX_CHUNK * p->n_heads * p->seq_len * sizeof(float));
+    memset(s->logits, 0, MAX_CHUNK * p->vocab_size * sizeof(float));
+    memset(s->lora_h, 0, 2 * MAX_CHUNK * MAX_LORA_RANK * sizeof(float));
+}
+
 void zero_run_state(RunState* s, Config* p) {
-    // we calloc instead of malloc to keep valgrind happy
-    memset(s->x, 0, p->dim * sizeof(float));
-    memset(s->xb, 0, p->dim * sizeof(float));
-    memset(s->xb2, 0, p->dim * sizeof(float));
-    memset(s->hb, 0,p->hidden_dim * sizeof(float));
-    memset(s->hb2, 0,p->hidden_dim * sizeof(float));
-    memset(s->q, 0,p->dim * sizeof(float));
-    memset(s->k, 0,p->dim * sizeof(float));
-    memset(s->v, 0,p->dim * sizeof(float));
-    memset(s->att, 0,p->n_heads * p->seq_len * sizeof(float));
-    memset(s->logits, 0,p->vocab_size * sizeof(float));
-    memset(s->key_cache, 0,p->n_layers * p->seq_len * p->dim * sizeof(float));
-    memset(s->value_cache, 0,p->n_layers * p->seq_len * p->dim * sizeof(float));
+    zero_activations(s, p);
+    memset(s->key_cache, 0, s->kv_bytes);
+    memset(s->value_cache, 0, s->kv_bytes);
 }
 
 void free_run_state(RunState* s) {
@@ -117,20 +289,27 @@ void free_run_state(RunState* s) {
     free(s->xb);
     free(s->xb2);
     free(s->hb);
-    free(s->hb2);
     free(s->q);
     free(s->k);
     free(s->v);
     free(s->att);
     free(s->logits);
-    free(s->key_cache);
-    free(s->value_cache);
+    free(s->lora_h);
+    free(s->xq);
+    free(s->xq_s);
+    free(s->block_table);
+    free(s->rope_freq);
+    free(s->rope_rows);
+    free(s->q_sink);
+    munmap(s->key_cache, s->kv_bytes);
+    munmap(s->value_cache, s->kv_bytes);
 }
 
 // ----------------------------------------------------------------------------
 // initialization: read from checkpoint
 
 void checkpoint_init_weights(TransformerWeights *w, Config* p, float* f, int shared_weights) {
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
     float* ptr = f;
     w->token_embedding_table = ptr;
     ptr += p->vocab_size * p->dim;
@@ -139,9 +318,9 @@ void checkpoint_init_weights(TransformerWeights *w, Config* p, float* f, int sha
     w->wq = ptr;
     ptr += p->n_layers * p->dim * p->dim;
     w->wk = ptr;
-    ptr += p->n_layers * p->dim * p->dim;
+    ptr += p->n_layers * p->dim * kv_dim;
     w->wv = ptr;
-    ptr += p->n_layers * p->dim * p->dim;
+    ptr += p->n_layers * p->dim * kv_dim;
     w->wo = ptr;
     ptr += p->n_layers * p->dim * p->dim;
     w->rms_ffn_weight = ptr;
@@ -154,14 +333,270 @@ void checkpoint_init_weights(TransformerWeights *w, Config* p, float* f, int sha
     ptr += p->n_layers * p->dim * p->hidden_dim;
     w->rms_final_weight = ptr;
     ptr += p->dim;
-    w->freq_cis_real = ptr;
+    // freq_cis_real and freq_cis_imag follow, but the RoPE tables are computed at load instead
     int head_size = p->dim / p->n_heads;
-    ptr += p->seq_len * head_size / 2;
-    w->freq_cis_imag = ptr;
-    ptr += p->seq_len * head_size / 2;
+    ptr += p->seq_len * head_size;
     w->wcls = shared_weights ? w->token_embedding_table : ptr;
 }
 
+// how the RoPE tables stretch to a context longer than the model was trained for
+typedef enum { ROPE_NONE, ROPE_LINEAR, ROPE_NTK } RopeScaling;
+
+void rope_params(int seq_len, int head_size, int train_len, RopeScaling scaling, float* theta, float* factor) {
+    // past the train_len positions the model was trained on, positions can be scaled by
+    // factor = seq_len / train_len: linear interpolates them back into the trained range
+    // (pos / factor), NTK keeps the fast rotations and stretches the slow ones, by raising
+    // the base to theta * factor^(d/(d-2))
+    *factor = seq_len > train_len && scaling != ROPE_NONE ? (float)seq_len / train_len : 1.0f;
+    *theta = 10000.0f;
+    if (*factor > 1.0f && scaling == ROPE_NTK) { *theta *= powf(*factor, head_size / (head_size - 2.0f)); }
+}
+
+void precompute_freq_cis(float* freq_cis_real, float* freq_cis_imag, int seq_len, int head_size,
+                         int train_len, RopeScaling scaling) {
+    // same tables as precompute_freqs_cis in model.py, for seq_len positions, scaled by rope_params
+    float theta, factor;
+    rope_params(seq_len, head_size, train_len, scaling, &theta, &factor);
+    for (int pos = 0; pos < seq_len; pos++) {
+        for (int i = 0; i < head_size / 2; i++) {
+            float freq = 1.0f / powf(theta, (2.0f * i) / head_size);
+            float val = scaling == ROPE_LINEAR ? pos / factor * freq : pos * freq;
+            freq_cis_real[pos * head_size / 2 + i] = cosf(val);
+            freq_cis_imag[pos * head_size / 2 + i] = sinf(val);
+        }
+    }
+}
+
+QuantizedTensor init_quantized_tensor(void** ptr, size_t n, int group_size) {
+    // n int8 values followed by their n / group_size float scales
+    QuantizedTensor t;
+    t.h = NULL;
+    t.q = (int8_t*)*ptr;
+    *ptr = (int8_t*)*ptr + n;
+    t.s = (float*)*ptr;
+    *ptr = (float*)*ptr + n / group_size;
+    return t;
+}
+
+void checkpoint_init_quantized_weights(QuantizedWeights *w, Config* p, void* f, int shared_weights) {
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int gs = w->group_size;
+    size_t dim = p->dim, hidden_dim = p->hidden_dim, n_layers = p->n_layers;
+    // the fp32 rmsnorm weights come first, so that the quantized tensors stay 4-byte aligned
+    float* fptr = (float*)f;
+    w->rms_att_weight = fptr;
+    fptr += n_layers * dim;
+    w->rms_ffn_weight = fptr;
+    fptr += n_layers * dim;
+    w->rms_final_weight = fptr;
+    fptr += dim;
+    void* ptr = fptr;
+    w->token_embedding_table = init_quantized_tensor(&ptr, p->vocab_size * dim, gs);
+    w->wq = init_quantized_tensor(&ptr, n_layers * dim * dim, gs);
+    w->wk = init_quantized_tensor(&ptr, n_layers * dim * kv_dim, gs);
+    w->wv = init_quantized_tensor(&ptr, n_layers * dim * kv_dim, gs);
+    w->wo = init_quantized_tensor(&ptr, n_layers * dim * dim, gs);
+    w->w1 = init_quantized_tensor(&ptr, n_layers * dim * hidden_dim, gs);
+    w->w2 = init_quantized_tensor(&ptr, n_layers * hidden_dim * dim, gs);
+    w->w3 = init_quantized_tensor(&ptr, n_layers * dim * hidden_dim, gs);
+    w->wcls = shared_weights ? w->token_embedding_table : init_quantized_tensor(&ptr, p->vocab_size * dim, gs);
+}
+
+int checkpoint_init_tensors(TransformerWeights* w, QuantizedWeights* qw, Config* p, TensorEntry* table,
+                            int quantized, char* data, long file_size) {
+    // point the weights at the tensors of a version 3 checkpoint, checking every entry
+    // of its table first. returns nonzero on failure
+    size_t dim = p->dim, hidden_dim = p->hidden_dim, n_layers = p->n_layers, vocab_size = p->vocab_size;
+    size_t kv_dim = (dim * p->n_kv_heads) / p->n_heads;
+    size_t freq_size = (size_t)p->seq_len * (dim / p->n_heads) / 2;
+    size_t n[N_TENSORS] = {
+        vocab_size * dim, n_layers * dim, n_layers * dim, n_layers * dim * dim, n_layers * dim * kv_dim,
+        n_layers * dim * kv_dim, n_layers * dim * dim, n_layers * dim * hidden_dim, n_layers * hidden_dim * dim,
+        n_layers * dim * hidden_dim, dim, freq_size, freq_size, vocab_size * dim
+    };
+    float* __restrict__* wslot[N_TENSORS] = {
+        &w->token_embedding_table, &w->rms_att_weight, &w->rms_ffn_weight, &w->wq, &w->wk, &w->wv, &w->wo,
+        &w->w1, &w->w2, &w->w3, &w->rms_final_weight, &w->freq_cis_real, &w->freq_cis_imag, &w->wcls
+    };
+    // with int8 weights, the fp32 tensors land in qfslot and the int8 ones in qslot
+    float** qfslot[N_TENSORS] = {
+        NULL, &qw->rms_att_weight, &qw->rms_ffn_weight, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, &qw->rms_final_weight, &qw->freq_cis_real, &qw->freq_cis_imag, NULL
+    };
+    QuantizedTensor* qslot[N_TENSORS] = {
+        &qw->token_embedding_table, NULL, NULL, &qw->wq, &qw->wk, &qw->wv, &qw->wo,
+        &qw->w1, &qw->w2, &qw->w3, NULL, NULL, NULL, &qw->wcls
+    };
+    for (int i = 0; i < N_TENSORS; i++) {
+        TensorEntry e = table[i];
+        // the RoPE tables are computed at load, whether the checkpoint has them or not
+        if (i == TENSOR_FREQ_CIS_REAL || i == TENSOR_FREQ_CIS_IMAG) { continue; }
+        int q8 = quantized && qslot[i] != NULL && qw->dtype == DTYPE_Q8_0;
+        int half = quantized && qslot[i] != NULL && qw->dtype != DTYPE_Q8_0; // fp16 or bf16
+        uint64_t bytes = q8 ? n[i] : n[i] * (half ? sizeof(uint16_t) : sizeof(float));
+        uint64_t scale_bytes = q8 ? n[i] / qw->group_size * sizeof(float) : 0;
+        if (e.offset == 0) {
+            if (i == TENSOR_WCLS) { continue; }
+            printf("Checkpoint is missing tensor %d\n", i);
+            return 1;
+        }
+        if (e.offset % CHECKPOINT_ALIGN != 0 || e.scales % CHECKPOINT_ALIGN != 0 || (e.scales != 0) != q8
+            || e.offset > (uint64_t)file_size || bytes > (uint64_t)file_size - e.offset
+            || e.scales > (uint64_t)file_size || scale_bytes > (uint64_t)file_size - e.scales) {
+            printf("Invalid checkpoint entry for tensor %d\n", i);
+            return 1;
+        }
+        if (!quantized) {
+            *wslot[i] = (float*)(data + e.offset);
+        } else if (q8) {
+            qslot[i]->q = (int8_t*)(data + e.offset);
+            qslot[i]->s = (float*)(data + e.scales);
+            qslot[i]->h = NULL;
+        } else if (half) {
+            qslot[i]->q = NULL;
+            qslot[i]->s = NULL;
+            qslot[i]->h = (uint16_t*)(data + e.offset);
+        } else {
+            *qfslot[i] = (float*)(data + e.offset);
+        }
+    }
+    if (table[TENSOR_WCLS].offset == 0) {
+        if (quantized) { qw->wcls = qw->token_embedding_table; } else { w->wcls = w->token_embedding_table; }
+    }
+    return 0;
+}
+
+void free_weights(TransformerWeights* w, QuantizedWeights* qw, int quantized) {
+    // only freq_cis live outside the checkpoint mapping, they are computed at load
+    free(quantized ? qw->freq_cis_real : w->freq_cis_real);
+    free(quantized ? qw->freq_cis_imag : w->freq_cis_imag);
+}
+
+int read_checkpoint(char* checkpoint, Config* config, TransformerWeights* weights, QuantizedWeights* qweights,
+                    int* quantized, int* shared_weights, float** data, long* file_size, int* fd,
+                    int writable, int hugepages, int ctx, RopeScaling rope_scaling, int* train_len) {
+    // read the Config of a legacy fp32, a version 2 int8 or a version 3 (fp32, int8, fp16 or bf16)
+    // checkpoint and mmap its weights.
+    // unless writable (for fine-tuning) the mapping is read-only and shared, so processes
+    // running the same checkpoint share its page cache pages for sure. a checkpoint on
+    // hugetlbfs is mapped with its huge pages, else hugepages asks for transparent ones.
+    // the RoPE tables are computed for ctx positions, or the exported seq_len if ctx is 0, and
+    // config->seq_len becomes that, train_len is the exported one. returns nonzero on failure
+    *quantized = 0; // 1 if the checkpoint holds int8, fp16 or bf16 weights, in qweights
+    FILE *file = fopen(checkpoint, "rb");
+    if (!file) {
+        printf("Unable to open the checkpoint file %s!\n", checkpoint);
+        return 1;
+    }
+    // versioned checkpoints start with a magic number, legacy fp32 ones directly with the Config
+    uint32_t magic;
+    int version = 0;
+    long header_size = sizeof(Config);
+    TensorEntry table[N_TENSORS] = {0}; // of a version 3 checkpoint
+    if(fread(&magic, sizeof(uint32_t), 1, file) != 1) { return 1; }
+    if(magic == CHECKPOINT_MAGIC && fread(&version, sizeof(int), 1, file) != 1) { return 1; }
+    if (version == 3) {
+        CheckpointHeader h;
+        fseek(file, 0, SEEK_SET);
+        if(fread(&h, sizeof(h), 1, file) != 1) { return 1; }
+        *config = h.config;
+        if (h.dtype > DTYPE_BF16) { printf("Unsupported checkpoint dtype %u\n", h.dtype); return 1; }
+        *quantized = h.dtype != DTYPE_FP32;
+        *shared_weights = (h.flags & CHECKPOINT_SHARED_CLASSIFIER) != 0;
+        qweights->dtype = h.dtype;
+        qweights->group_size = h.group_size;
+        if (h.dtype == DTYPE_Q8_0 && (h.group_size <= 0 || config->dim % h.group_size != 0 || config->hidden_dim % h.group_size != 0)) {
+            printf("Invalid quantization group size %d\n", h.group_size);
+            return 1;
+        }
+        // newer writers may append tensors this reader doesn't know about
+        int n_tensors = h.n_tensors < N_TENSORS ? h.n_tensors : N_TENSORS;
+        fseek(file, CHECKPOINT_ALIGN, SEEK_SET);
+        if(n_tensors < 0 || fread(table, sizeof(TensorEntry), n_tensors, file) != (size_t)n_tensors) { return 1; }
+        if (*shared_weights) { table[TENSOR_WCLS].offset = 0; }
+    } else if (magic == CHECKPOINT_MAGIC) {
+        // magic, version, Config, uint8 shared_weights, int group_size, padded to 256 bytes
+        uint8_t shared;
+        if (version != 2) { printf("Unsupported checkpoint version %d\n", version); return 1; }
+        if(fread(config, sizeof(Config), 1, file) != 1) { return 1; }
+        if(fread(&shared, sizeof(uint8_t), 1, file) != 1) { return 1; }
+        if(fread(&qweights->group_size, sizeof(int), 1, file) != 1) { return 1; }
+        int gs = qweights->group_size;
+        if (gs <= 0 || config->dim % gs != 0 || config->hidden_dim % gs != 0) {
+            printf("Invalid quantization group size %d\n", gs);
+            return 1;
+        }
+        *shared_weights = shared;
+        *quantized = 1;
+        qweights->dtype = DTYPE_Q8_0;
+        header_size = 256;
+    } else {
+        fseek(file, 0, SEEK_SET);
+        if(fread(config, sizeof(Config), 1, file) != 1) { return 1; }
+        // negative vocab size is hacky way of signaling unshared weights. bit yikes.
+        *shared_weights = config->vocab_size > 0 ? 1 : 0;
+        config->vocab_size = abs(config->vocab_size);
+    }
+    // figure out the file size
+    fseek(file, 0, SEEK_END); // move file pointer to end of file
+    *file_size = ftell(file); // get the file size, in bytes
+    fclose(file);
+    // memory map the Transformer weights into the data pointer
+    *fd = open(checkpoint, O_RDONLY); // open in read only mode
+    if (*fd == -1) { printf("open failed!\n"); return 1; }
+#ifdef __linux__
+    struct statfs fs;
+    if (fstatfs(*fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC) {
+        // mappings of hugetlbfs files come in whole huge pages, and must be unmapped as such
+        *file_size = (*file_size + fs.f_bsize - 1) / fs.f_bsize * fs.f_bsize;
+        hugepages = 0;
+    }
+#endif
+    if (writable) {
+        *data = mmap(NULL, *file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, *fd, 0);
+    } else {
+        *data = mmap(NULL, *file_size, PROT_READ, MAP_SHARED, *fd, 0);
+    }
+    if (*data == MAP_FAILED) { printf("mmap failed!\n"); return 1; }
+#ifdef MADV_HUGEPAGE
+    // only takes for read-only file mappings on kernels with CONFIG_READ_ONLY_THP_FOR_FS
+    if (hugepages && madvise(*data, *file_size, MADV_HUGEPAGE) != 0) {
+        fprintf(stderr, "madvise(MADV_HUGEPAGE) failed, using normal pages\n");
+    }
+#endif
+    if (version == 3) {
+        if (checkpoint_init_tensors(weights, qweights, config, table, *quantized, (char*)*data, *file_size)) { return 1; }
+    } else if (*quantized) {
+        checkpoint_init_quantized_weights(qweights, config, (char*)*data + header_size, *shared_weights);
+    } else {
+        checkpoint_init_weights(weights, config, *data + header_size/sizeof(float), *shared_weights);
+    }
+    // even checkpoints that carry RoPE tables only have them for the exported seq_len
+    *train_len = config->seq_len;
+    if (ctx > 0) { config->seq_len = ctx; }
+    int head_size = config->dim / config->n_heads;
+    float* real = malloc((size_t)config->seq_len * head_size / 2 * sizeof(float));
+    float* imag = malloc((size_t)config->seq_len * head_size / 2 * sizeof(float));
+    if (!real || !imag) { printf("malloc failed!\n"); exit(1); }
+    precompute_freq_cis(real, imag, config->seq_len, head_size, *train_len, rope_scaling);
+    if (*quantized) { qweights->freq_cis_real = real; qweights->freq_cis_imag = imag; }
+    else { weights->freq_cis_real = real; weights->freq_cis_imag = imag; }
+    return 0;
+}
+
+int remap_writable(float* data, long file_size, int fd) {
+    // turns the read-only shared mapping of a checkpoint into a private writable one, in place,
+    // so every pointer into it stays valid. pages are only copied once they are written. mappings
+    // that are writable already (fine-tuning, the anonymous copy of --numa) are left as they are.
+    // returns nonzero on failure
+    if (mprotect(data, file_size, PROT_READ | PROT_WRITE) == 0) { return 0; }
+    if (mmap(data, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        printf("mmap failed!\n");
+        return 1;
+    }
+    return 0;
+}
+
 // ----------------------------------------------------------------------------
 // neural net blocks
 
@@ -206,467 +641,3939 @@ void softmax(float* x, int size) {
     }
 }
 
-void matmul(float* xout, float* x, float* w, int n, int d) {
-    // W (d,n) @ x (n,) -> xout (d,)
-    #pragma omp parallel for
-    for (int i = 0; i < d; i++) {
-        float val = 0.0f;
-        for (int j = 0; j < n; j++) {
-            val += w[i * n + j] * x[j];
-        }
-        xout[i] = val;
+// dot product kernels. without -ffast-math the compiler may not reorder a float sum, so
+// a plain accumulator loop stays scalar. these split the sum over several independent
+// accumulators by hand instead, and the best one for the running CPU is picked at startup
+
+typedef enum { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 } SimdLevel;
+SimdLevel simd_level = SIMD_SCALAR; // set by init_simd()
+int have_f16c = 0; // also set by init_simd(), the AVX2 kernel for fp16 needs F16C for its conversions
+
+float dot_scalar(float* a, float* b, int n) {
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i+1] * b[i+1];
+        s2 += a[i+2] * b[i+2];
+        s3 += a[i+3] * b[i+3];
     }
+    for (; i < n; i++) {
+        s0 += a[i] * b[i];
+    }
+    return (s0 + s1) + (s2 + s3);
 }
 
-void transformer(int token, int pos, Config* __restrict__ p, RunState* __restrict__ s, TransformerWeights* __restrict__ w) {
-    
-    // a few convenience variables
-    float *x = s->x;
-    int dim = p->dim;
-    int hidden_dim =  p->hidden_dim;
-    int head_size = dim / p->n_heads;
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2,fma")))
+float dot_avx2(float* a, float* b, int n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), acc3);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    __m256 acc = _mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3));
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum = _mm_hadd_ps(sum, sum);
+    sum = _mm_hadd_ps(sum, sum);
+    float s = _mm_cvtss_f32(sum);
+    for (; i < n; i++) {
+        s += a[i] * b[i];
+    }
+    return s;
+}
 
-    // copy the token embedding into x
-    float* content_row = &(w->token_embedding_table[token * dim]);
-    memcpy(x, content_row, dim*sizeof(*x));
+__attribute__((target("avx512f")))
+float dot_avx512(float* a, float* b, int n) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 64 <= n; i += 64) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+        acc2 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 32), _mm512_loadu_ps(b + i + 32), acc2);
+        acc3 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 48), _mm512_loadu_ps(b + i + 48), acc3);
+    }
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    }
+    if (i < n) {
+        // masked load of the tail, the masked out lanes read as zero
+        __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), acc1);
+    }
+    __m512 acc = _mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3));
+    return _mm512_reduce_add_ps(acc);
+}
+#endif
 
-    // pluck out the "pos" row of freq_cis_real and freq_cis_imag
-    float* freq_cis_real_row = w->freq_cis_real + pos * head_size / 2;
-    float* freq_cis_imag_row = w->freq_cis_imag + pos * head_size / 2;
+#if defined(__ARM_NEON)
+float dot_neon(float* a, float* b, int n) {
+    // NEON is part of the baseline on aarch64, so there's nothing to dispatch on
+    float32x4_t acc0 = vdupq_n_f32(0.0f), acc1 = vdupq_n_f32(0.0f);
+    float32x4_t acc2 = vdupq_n_f32(0.0f), acc3 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        acc2 = vfmaq_f32(acc2, vld1q_f32(a + i + 8), vld1q_f32(b + i + 8));
+        acc3 = vfmaq_f32(acc3, vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    float s = vaddvq_f32(vaddq_f32(vaddq_f32(acc0, acc1), vaddq_f32(acc2, acc3)));
+    for (; i < n; i++) {
+        s += a[i] * b[i];
+    }
+    return s;
+}
+#endif
 
-    // forward all the layers
-    for(int l = 0; l < p->n_layers; l++) {
-    
-        // attention rmsnorm
-        rmsnorm(s->xb, x, w->rms_att_weight + l*dim, dim);
-
-        // qkv matmuls for this position
-        matmul(s->q, s->xb, w->wq + l*dim*dim, dim, dim);
-        matmul(s->k, s->xb, w->wk + l*dim*dim, dim, dim);
-        matmul(s->v, s->xb, w->wv + l*dim*dim, dim, dim);
-
-        // apply RoPE rotation to the q and k vectors for each head
-        for (int h = 0; h < p->n_heads; h++) {
-            // get the q and k vectors for this head
-            float* q = s->q + h * head_size;
-            float* k = s->k + h * head_size;
-            // rotate q and k by the freq_cis_real and freq_cis_imag
-            for (int i = 0; i < head_size; i+=2) {
-                float q0 = q[i];
-                float q1 = q[i+1];
-                float k0 = k[i];
-                float k1 = k[i+1];
-                float fcr = freq_cis_real_row[i/2];
-                float fci = freq_cis_imag_row[i/2];
-                q[i]   = q0 * fcr - q1 * fci;
-                q[i+1] = q0 * fci + q1 * fcr;
-                k[i]   = k0 * fcr - k1 * fci;
-                k[i+1] = k0 * fci + k1 * fcr;
-            }
-        }
-
-        // save key,value at this time step (pos) to our kv cache
-        int loff = l * p->seq_len * dim; // kv cache layer offset for convenience
-        float* key_cache_row = s->key_cache + loff + pos * dim;
-        float* value_cache_row = s->value_cache + loff + pos * dim;
-        memcpy(key_cache_row, s->k, dim*sizeof(*key_cache_row));
-        memcpy(value_cache_row, s->v, dim*sizeof(*value_cache_row));
-        
-        // multihead attention. iterate over all heads
-        #pragma omp parallel for
-        for (int h = 0; h < p->n_heads; h++) {
-            // get the query vector for this head
-            float* q = s->q + h * head_size;
-            // attention scores for this head
-            float* att = s->att + h * p->seq_len;
-            // iterate over all timesteps, including the current one
-            for (int t = 0; t <= pos; t++) {
-                // get the key vector for this head and at this timestep
-                float* k = s->key_cache + loff + t * dim + h * head_size;
-                // calculate the attention score as the dot product of q and k
-                float score = 0.0f;
-                for (int i = 0; i < head_size; i++) {
-                    score += q[i] * k[i];
-                }
-                score /= sqrtf(head_size);
-                // save the score to the attention buffer
-                att[t] = score;
-            }
-
-            // softmax the scores to get attention weights, from 0..pos inclusively
-            softmax(att, pos + 1);
-            
-            // weighted sum of the values, store back into xb
-            for (int i = 0; i < head_size; i++) {
-                float val = 0.0f;
-                for (int t = 0; t <= pos; t++) {
-                    val += att[t] * s->value_cache[loff + t * dim + h * head_size + i]; // note bad locality
-                }
-                s->xb[h * head_size + i] = val;
-            }
-        }
+void init_simd(SimdLevel max_level) {
+    // pick the widest vector extension the CPU supports, up to max_level
+    simd_level = SIMD_SCALAR;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (max_level >= SIMD_AVX2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) { simd_level = SIMD_AVX2; }
+    if (max_level >= SIMD_AVX512 && __builtin_cpu_supports("avx512f")) { simd_level = SIMD_AVX512; }
+    have_f16c = __builtin_cpu_supports("f16c");
+#endif
+}
 
-        // final matmul to get the output of the attention
-        matmul(s->xb2, s->xb, w->wo + l*dim*dim, dim, dim);
+float dot(float* a, float* b, int n) {
+#if defined(__ARM_NEON)
+    return dot_neon(a, b, n);
+#else
+#ifdef HAVE_X86_SIMD
+    if (simd_level == SIMD_AVX512) { return dot_avx512(a, b, n); }
+    if (simd_level == SIMD_AVX2) { return dot_avx2(a, b, n); }
+#endif
+    return dot_scalar(a, b, n);
+#endif
+}
 
-        // residual connection back into x
-        accum(x, s->xb2, dim);
+// 16-bit floats: bf16 is the top half of an fp32, fp16 is IEEE half precision. weights and the
+// kv cache can be stored in either, they are widened to fp32 on load and summed in fp32
 
-        // ffn rmsnorm
-        rmsnorm(s->xb, x, w->rms_ffn_weight + l*dim, dim);
+uint16_t float_to_bf16(float f) {
+    // round to nearest even, keeping NaNs NaN
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    if ((u & 0x7fffffff) > 0x7f800000) { return (u >> 16) | 0x40; }
+    u += 0x7fff + ((u >> 16) & 1);
+    return u >> 16;
+}
 
-        // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
-        // first calculate self.w1(x) and self.w3(x)
-        matmul(s->hb, s->xb, w->w1 + l*dim*hidden_dim, dim, hidden_dim);
-        matmul(s->hb2, s->xb, w->w3 + l*dim*hidden_dim, dim, hidden_dim);
-        
-        // F.silu; silu(x)=x*σ(x),where σ(x) is the logistic sigmoid
-        for (int i = 0; i < hidden_dim; i++) {
-            s->hb[i] = s->hb[i] * (1.0f / (1.0f + expf(-s->hb[i])));
-        }
-        
-        // elementwise multiply with w3(x)
-        for (int i = 0; i < hidden_dim; i++) {
-            s->hb[i] = s->hb[i] * s->hb2[i];
-        }
+float bf16_to_float(uint16_t h) {
+    uint32_t u = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
 
-        // final matmul to get the output of the ffn
-        matmul(s->xb, s->hb, w->w2 + l*dim*hidden_dim, hidden_dim, dim);
+uint16_t float_to_f16(float f) {
+    // round to nearest even. out of range values become infinities, NaNs stay NaN
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    uint16_t sign = (u >> 16) & 0x8000;
+    uint32_t a = u & 0x7fffffff;
+    if (a > 0x7f800000) { return sign | 0x7e00; }
+    if (a >= 0x477ff000) { return sign | 0x7c00; } // rounds past 65504, the largest half
+    if (a < 0x38800000) {
+        // below 2^-14 halves are subnormal, multiples of 2^-24
+        float v;
+        memcpy(&v, &a, sizeof(v));
+        return sign | (uint16_t)nearbyintf(v * 16777216.0f);
+    }
+    a += ((uint32_t)(15 - 127) << 23) + 0xfff + ((a >> 13) & 1); // rebias, and round off 13 bits
+    return sign | (a >> 13);
+}
 
-        // residual connection
-        accum(x, s->xb, dim);
+float f16_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    if (exp == 0) {
+        float f = mant * (1.0f / 16777216.0f); // zero or subnormal, exact
+        return sign ? -f : f;
     }
-    
-    // final rmsnorm
-    rmsnorm(x, x, w->rms_final_weight, dim);
+    uint32_t u = sign | (exp == 0x1f ? 0x7f800000 : (exp + 127 - 15) << 23) | (mant << 13);
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
 
-    // classifier into logits
-    matmul(s->logits, x, w->wcls, p->dim, p->vocab_size);
+float half_to_float(uint16_t h, int bf16) {
+    return bf16 ? bf16_to_float(h) : f16_to_float(h);
 }
 
-int sample(float* probabilities, int n) {
-    // sample index from probabilities, they must sum to 1
-    float r = (float)rand() / (float)RAND_MAX;
-    float cdf = 0.0f;
-    for (int i = 0; i < n; i++) {
-        cdf += probabilities[i];
-        if (r < cdf) {
-            return i;
-        }
+uint16_t float_to_half(float f, int bf16) {
+    return bf16 ? float_to_bf16(f) : float_to_f16(f);
+}
+
+float dot_half_scalar(uint16_t* a, float* b, int n, int bf16) {
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += half_to_float(a[i], bf16) * b[i];
+        s1 += half_to_float(a[i+1], bf16) * b[i+1];
+        s2 += half_to_float(a[i+2], bf16) * b[i+2];
+        s3 += half_to_float(a[i+3], bf16) * b[i+3];
     }
-    return n - 1; // in case of rounding errors
+    for (; i < n; i++) {
+        s0 += half_to_float(a[i], bf16) * b[i];
+    }
+    return (s0 + s1) + (s2 + s3);
 }
 
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2,fma,f16c")))
+__m256 load_half_avx2(uint16_t* p, int bf16) {
+    // 8 fp16 or bf16 values widened to fp32. bf16 just goes into the top half of each lane
+    __m128i h = _mm_loadu_si128((__m128i*)p);
+    if (bf16) { return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16)); }
+    return _mm256_cvtph_ps(h);
+}
 
-int argmax(float* v, int n) {
-    // return argmax of v in elements 0..n
-    int max_i = 0;
-    float max_p = v[0];
-    for (int i = 1; i < n; i++) {
-        if (v[i] > max_p) {
-            max_i = i;
-            max_p = v[i];
-        }
+__attribute__((target("avx2,fma,f16c")))
+float dot_half_avx2(uint16_t* a, float* b, int n, int bf16) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm256_fmadd_ps(load_half_avx2(a + i, bf16), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(load_half_avx2(a + i + 8, bf16), _mm256_loadu_ps(b + i + 8), acc1);
+        acc2 = _mm256_fmadd_ps(load_half_avx2(a + i + 16, bf16), _mm256_loadu_ps(b + i + 16), acc2);
+        acc3 = _mm256_fmadd_ps(load_half_avx2(a + i + 24, bf16), _mm256_loadu_ps(b + i + 24), acc3);
     }
-    return max_i;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(load_half_avx2(a + i, bf16), _mm256_loadu_ps(b + i), acc0);
+    }
+    __m256 acc = _mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3));
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum = _mm_hadd_ps(sum, sum);
+    sum = _mm_hadd_ps(sum, sum);
+    float s = _mm_cvtss_f32(sum);
+    for (; i < n; i++) {
+        s += half_to_float(a[i], bf16) * b[i];
+    }
+    return s;
 }
 
+__attribute__((target("avx512f")))
+__m512 load_half_avx512(uint16_t* p, int bf16) {
+    __m256i h = _mm256_loadu_si256((__m256i*)p);
+    if (bf16) { return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16)); }
+    return _mm512_cvtph_ps(h);
+}
 
-float loss(int token, int pos, Config* __restrict__ config, RunState* __restrict__ s, TransformerWeights* __restrict__ w, int nexttok, float temperature) {
-    transformer(token, pos, config, s, w);
+__attribute__((target("avx512f")))
+float dot_half_avx512(uint16_t* a, float* b, int n, int bf16) {
+    // AVX-512 BF16's dot product instruction would need the activations rounded to bf16 too,
+    // widening the weights keeps them fp32 at the same cost, the loads are what's bound
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 64 <= n; i += 64) {
+        acc0 = _mm512_fmadd_ps(load_half_avx512(a + i, bf16), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(load_half_avx512(a + i + 16, bf16), _mm512_loadu_ps(b + i + 16), acc1);
+        acc2 = _mm512_fmadd_ps(load_half_avx512(a + i + 32, bf16), _mm512_loadu_ps(b + i + 32), acc2);
+        acc3 = _mm512_fmadd_ps(load_half_avx512(a + i + 48, bf16), _mm512_loadu_ps(b + i + 48), acc3);
+    }
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_fmadd_ps(load_half_avx512(a + i, bf16), _mm512_loadu_ps(b + i), acc0);
+    }
+    __m512 acc = _mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3));
+    float s = _mm512_reduce_add_ps(acc);
+    for (; i < n; i++) {
+        s += half_to_float(a[i], bf16) * b[i];
+    }
+    return s;
+}
+#endif
 
-    // apply the temperature to the logits
-    for (int q=0; q<config->vocab_size; q++) { s->logits[q] /= temperature; }
+#if defined(__ARM_NEON)
+float32x4_t load_half_neon(uint16_t* p, int bf16) {
+    uint16x4_t h = vld1_u16(p);
+    if (bf16) { return vreinterpretq_f32_u32(vshll_n_u16(h, 16)); }
+    return vcvt_f32_f16(vreinterpret_f16_u16(h));
+}
 
-    // apply softmax to the logits to get the probabilities for next token
-    softmax(s->logits, config->vocab_size);
+float dot_half_neon(uint16_t* a, float* b, int n, int bf16) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f), acc1 = vdupq_n_f32(0.0f);
+    float32x4_t acc2 = vdupq_n_f32(0.0f), acc3 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = vfmaq_f32(acc0, load_half_neon(a + i, bf16), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, load_half_neon(a + i + 4, bf16), vld1q_f32(b + i + 4));
+        acc2 = vfmaq_f32(acc2, load_half_neon(a + i + 8, bf16), vld1q_f32(b + i + 8));
+        acc3 = vfmaq_f32(acc3, load_half_neon(a + i + 12, bf16), vld1q_f32(b + i + 12));
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc0 = vfmaq_f32(acc0, load_half_neon(a + i, bf16), vld1q_f32(b + i));
+    }
+    float s = vaddvq_f32(vaddq_f32(vaddq_f32(acc0, acc1), vaddq_f32(acc2, acc3)));
+    for (; i < n; i++) {
+        s += half_to_float(a[i], bf16) * b[i];
+    }
+    return s;
+}
+#endif
 
-    // we now want to sample from this distribution to get the next token
-    //next = sample(state.logits, config.vocab_size);
-    // https://github.com/keras-team/keras/blob/21c25fd38023a3783950c5577383ffe51a62f650/keras/backend_config.py#L34
-    return -log(s->logits[nexttok] + 1e-7);
+float dot_half(uint16_t* a, float* b, int n, int bf16) {
+    // dot product of n fp16 (or bf16) values with n fp32 ones, in fp32
+#if defined(__ARM_NEON)
+    return dot_half_neon(a, b, n, bf16);
+#else
+#ifdef HAVE_X86_SIMD
+    if (simd_level == SIMD_AVX512) { return dot_half_avx512(a, b, n, bf16); }
+    if (simd_level == SIMD_AVX2 && have_f16c) { return dot_half_avx2(a, b, n, bf16); }
+#endif
+    return dot_half_scalar(a, b, n, bf16);
+#endif
 }
 
-// ----------------------------------------------------------------------------
+void matmul(float* xout, float* x, float* w, int n, int d, int nt) {
+    // W (d,n) @ X^T, X (nt,n) -> xout (nt,d). each row of W is read from memory once
+    // and reused for all nt tokens while it is still in cache
+    #pragma omp parallel for
+    for (int i = 0; i < d; i++) {
+        float* wi = w + (size_t)i * n;
+        for (int t = 0; t < nt; t++) {
+            xout[(size_t)t * d + i] = dot(wi, x + (size_t)t * n, n);
+        }
+    }
+}
 
-long time_in_ms() {
-    struct timespec time;
-    // Get the current time with nanosecond precision
-    if (clock_gettime(CLOCK_REALTIME, &time) == 0) {
-        return time.tv_sec * 1000 + time.tv_nsec / 1000000;
-    } else {
-        perror("clock_gettime");
-        return -1; // Return -1 to indicate an error
+void matmul_qkv(float* q, float* k, float* v, float* x, float* wq, float* wk, float* wv, int n, int dq, int dkv, int nt) {
+    // the q, k and v projections of the same x in one parallel loop over all their rows,
+    // instead of three matmuls that each fork/join and re-read x. x is (nt,n)
+    #pragma omp parallel for
+    for (int i = 0; i < dq + 2 * dkv; i++) {
+        for (int t = 0; t < nt; t++) {
+            float* xt = x + (size_t)t * n;
+            if (i < dq) { q[(size_t)t * dq + i] = dot(wq + (size_t)i * n, xt, n); }
+            else if (i < dq + dkv) { k[(size_t)t * dkv + i - dq] = dot(wk + (size_t)(i - dq) * n, xt, n); }
+            else { v[(size_t)t * dkv + i - dq - dkv] = dot(wv + (size_t)(i - dq - dkv) * n, xt, n); }
+        }
     }
 }
 
-int enzyme_const;
-int enzyme_primal_return;
-int enzyme_dup;
-float __enzyme_autodiff(void*, 
-        int,
-        int, int,
-        int, int,
-        int, Config*,
-        int, RunState*, RunState*,
-        int, TransformerWeights*, TransformerWeights*,
-        int,
-        int, float);
+void matmul_swiglu(float* hb, float* x, float* w1, float* w3, int n, int d, int nt) {
+    // hb = F.silu(W1 @ x) * (W3 @ x), both projections and the activation fused per row
+    #pragma omp parallel for
+    for (int i = 0; i < d; i++) {
+        for (int t = 0; t < nt; t++) {
+            float h1 = dot(w1 + (size_t)i * n, x + (size_t)t * n, n);
+            float h3 = dot(w3 + (size_t)i * n, x + (size_t)t * n, n);
+            // silu(x)=x*σ(x),where σ(x) is the logistic sigmoid
+            hb[(size_t)t * d + i] = h1 * (1.0f / (1.0f + expf(-h1))) * h3;
+        }
+    }
+}
 
-int main(int argc, char *argv[]) {
+void lora_matmul(float* xout, float* x, float* a, float* b, float* h, int n, int d, int rank, float scale, int nt) {
+    // adds an adapter's scale * B (A x) to xout (nt,d), the output of a matmul of x (nt,n).
+    // h (nt,rank) is scratch for A x
+    matmul(h, x, a, n, rank, nt);
+    #pragma omp parallel for
+    for (int i = 0; i < d; i++) {
+        for (int t = 0; t < nt; t++) {
+            xout[(size_t)t * d + i] += scale * dot(b + (size_t)i * rank, h + (size_t)t * rank, rank);
+        }
+    }
+}
 
-    // poor man's C argparse
-    char *checkpoint = NULL;  // e.g. out/model.bin
-    float temperature = 0.9f; // e.g. 1.0, or 0.0
-    int steps = 256;          // max number of steps to run for, 0: use seq_len
-    char *training_data = NULL;
-    // 'checkpoint' is necessary arg
-    if (argc < 2) {
-        printf("Usage: %s <checkpoint_file> [temperature] [steps] [training_data]\n", argv[0]);
-        return 1;
+void matmul_swiglu_lora(float* hb, float* x, float* w1, float* w3, float* b1, float* b3, float* h1, float* h3,
+                        int rank, float scale, int n, int d, int nt) {
+    // matmul_swiglu with adapters on w1 and w3, which go in before the activation. h1 and h3
+    // (nt,rank) already hold A1 x and A3 x
+    #pragma omp parallel for
+    for (int i = 0; i < d; i++) {
+        for (int t = 0; t < nt; t++) {
+            float v1 = dot(w1 + (size_t)i * n, x + (size_t)t * n, n) + scale * dot(b1 + (size_t)i * rank, h1 + (size_t)t * rank, rank);
+            float v3 = dot(w3 + (size_t)i * n, x + (size_t)t * n, n) + scale * dot(b3 + (size_t)i * rank, h3 + (size_t)t * rank, rank);
+            hb[(size_t)t * d + i] = v1 * (1.0f / (1.0f + expf(-v1))) * v3;
+        }
     }
-    if (argc >= 2) {
-        checkpoint = argv[1];
+}
+
+void dequantize(float* x, int8_t* q, float* s, int n, int group_size) {
+    // q and s point at the start of a group
+    for (int i = 0; i < n; i++) {
+        x[i] = q[i] * s[i / group_size];
     }
-    if (argc >= 3) {
-        // optional temperature. 0.0 = (deterministic) argmax sampling. 1.0 = baseline
-        temperature = atof(argv[2]);
+}
+
+void quantize(int8_t* q, float* s, float* x, int n, int group_size) {
+    // symmetric per-group quantization of x, each group scaled so its max |value| maps to 127
+    for (int g = 0; g < n / group_size; g++) {
+        float* xg = x + g * group_size;
+        float wmax = 0.0f;
+        for (int i = 0; i < group_size; i++) {
+            float val = fabsf(xg[i]);
+            if (val > wmax) { wmax = val; }
+        }
+        float scale = wmax / 127.0f;
+        float inv = scale > 0.0f ? 1.0f / scale : 0.0f;
+        s[g] = scale;
+        for (int i = 0; i < group_size; i++) {
+            q[g * group_size + i] = (int8_t)roundf(xg[i] * inv);
+        }
     }
-    if (argc >= 4) {
-        steps = atoi(argv[3]);
+}
+
+void dequantize_half(float* x, uint16_t* h, int n, int bf16) {
+    for (int i = 0; i < n; i++) {
+        x[i] = half_to_float(h[i], bf16);
     }
-    if(argc >= 5) {
-        training_data = argv[4];
+}
+
+void quantize_half(uint16_t* h, float* x, int n, int bf16) {
+    for (int i = 0; i < n; i++) {
+        h[i] = float_to_half(x[i], bf16);
     }
+}
 
-    // seed rng with time. if you want deterministic behavior use temperature 0.0
-    srand((unsigned int)1337);//time(NULL)); 
-    
-    // read in the model.bin file
-    Config config;
-    TransformerWeights weights;
-    TransformerWeights dweights;
-    int fd = 0;
-    float* data = NULL;
-    float* ddata = NULL;
-    float* weights_ptr;
-    float* dweights_ptr;
-    long file_size;
-    {
-        FILE *file = fopen(checkpoint, "rb");
-        if (!file) {
-            printf("Unable to open the checkpoint file %s!\n", checkpoint);
-            return 1;
+float dot_q8(int8_t* xq, float* xs, QuantizedTensor* w, size_t row, int n, int group_size) {
+    // dot product of quantized x with row `row` (of length n, offset in values) of w.
+    // the dot product of each group is done in int32, then scaled by both group scales
+    int8_t* wq = w->q + row;
+    float* ws = w->s + row / group_size;
+    float val = 0.0f;
+    for (int j = 0; j < n; j += group_size) {
+        int32_t ival = 0;
+        for (int k = 0; k < group_size; k++) {
+            ival += (int32_t)xq[j + k] * (int32_t)wq[j + k];
         }
-        // read in the config header
-        if(fread(&config, sizeof(Config), 1, file) != 1) { return 1; }
-        // negative vocab size is hacky way of signaling unshared weights. bit yikes.
-        int shared_weights = config.vocab_size > 0 ? 1 : 0;
-        config.vocab_size = abs(config.vocab_size);
-        // figure out the file size
-        fseek(file, 0, SEEK_END); // move file pointer to end of file
-        file_size = ftell(file); // get the file size, in bytes
-        fclose(file);
-        // memory map the Transformer weights into the data pointer
-        fd = open(checkpoint, O_RDONLY); // open in read only mode
-        if (fd == -1) { printf("open failed!\n"); return 1; }
-        data = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-        if (data == MAP_FAILED) { printf("mmap failed!\n"); return 1; }
-        ddata = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (ddata == MAP_FAILED) { printf("mmap failed!\n"); return 1; }
-        memset(ddata, 0, file_size);
-        weights_ptr = data + sizeof(Config)/sizeof(float);
-        dweights_ptr = ddata + sizeof(Config)/sizeof(float);
-        checkpoint_init_weights(&weights, &config, weights_ptr, shared_weights);
-        checkpoint_init_weights(&dweights, &config, dweights_ptr, shared_weights);
-    }
-    // right now we cannot run for more than config.seq_len steps
-    if (steps <= 0 || steps > config.seq_len) { steps = config.seq_len; }
+        val += (float)ival * ws[j / group_size] * xs[j / group_size];
+    }
+    return val;
+}
 
-    // read in the tokenizer.bin file
-    char** vocab = (char**)malloc(config.vocab_size * sizeof(char*));
-    {
-        FILE *file = fopen("tokenizer.bin", "rb");
-        if (!file) {
-            printf("Unable to open the tokenizer file tokenizer.bin! Run "
-            "python tokenizer.py to convert tokenizer.model -> tokenizer.bin\n");
-            return 1;
-        }
-        int len;
-        for (int i = 0; i < config.vocab_size; i++) {
-            if(fread(&len, sizeof(int), 1, file) != 1) { return 1; }
-            vocab[i] = (char *)malloc(len + 1);
-            if(fread(vocab[i], len, 1, file) != 1) { return 1; }
-            vocab[i][len] = '\0'; // add the string terminating token
+void rope_pair(float* v0, float* v1, float fcr, float fci) {
+    // rotate the pair (v0, v1) by the angle with cosine fcr and sine fci, RoPE's one operation
+    float r0 = *v0 * fcr - *v1 * fci;
+    *v1 = *v0 * fci + *v1 * fcr;
+    *v0 = r0;
+}
+
+void rope(Config* p, float* sq, float* sk, float* freq_cis_real_row, float* freq_cis_imag_row) {
+    int head_size = p->dim / p->n_heads;
+    // apply RoPE rotation to the q and k vectors of one token, for each head
+    for (int h = 0; h < p->n_heads; h++) {
+        // get the q vector for this head, and the k vector if this head owns one
+        float* q = sq + h * head_size;
+        float* k = h < p->n_kv_heads ? sk + h * head_size : NULL;
+        // rotate q and k by the freq_cis_real and freq_cis_imag
+        for (int i = 0; i < head_size; i+=2) {
+            float fcr = freq_cis_real_row[i/2];
+            float fci = freq_cis_imag_row[i/2];
+            rope_pair(&q[i], &q[i+1], fcr, fci);
+            if (k) { rope_pair(&k[i], &k[i+1], fcr, fci); }
         }
-        fclose(file);
     }
+}
 
-    // create and init the application RunState
-    RunState state;
-    malloc_run_state(&state, &config);
-    RunState dstate;
-    malloc_run_state(&dstate, &config);
+int kv_position(RunState* s, int pos) {
+    // where position pos of a sequence is in its kv cache. with the ring, positions past
+    // ring_len wrap around over the ones after the sinks, which stay pinned
+    if (s->ring_len == 0 || pos < s->ring_len) { return pos; }
+    return s->n_sink + (pos - s->n_sink) % (s->ring_len - s->n_sink);
+}
 
+size_t kv_offset(Config* p, RunState* s, int slot, int pos, int l, int h) {
+    // where the key (or the value) of kv head h in layer l at position pos of the sequence in kv
+    // slot slot starts in its cache, in values. within a block the cache is head-major, so that
+    // each head's keys/values over the block's timesteps are contiguous
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int head_size = p->dim / p->n_heads;
+    int c = kv_position(s, pos);
+    size_t block = s->block_table[slot * s->max_blocks + c / KV_BLOCK];
+    return (block * p->n_layers + l) * KV_BLOCK * kv_dim + (size_t)(h * KV_BLOCK + c % KV_BLOCK) * head_size;
+}
 
+void init_kv_ring(RunState* s, Config* p, int n_sink, int train_len, RopeScaling scaling) {
+    // turn slot 0's kv cache into a ring of seq_len positions with n_sink sinks, for generating
+    // past seq_len. rope_freq continues the RoPE tables of precompute_freq_cis past their end
+    int head_size = p->dim / p->n_heads;
+    float theta, factor;
+    rope_params(p->seq_len, head_size, train_len, scaling, &theta, &factor);
+    s->ring_len = p->seq_len;
+    s->n_sink = n_sink;
+    s->rope_freq = malloc(head_size / 2 * sizeof(double));
+    if (!s->rope_freq) { printf("malloc failed!\n"); exit(1); }
+    for (int i = 0; i < head_size / 2; i++) {
+        float freq = 1.0f / powf(theta, (2.0f * i) / head_size);
+        s->rope_freq[i] = scaling == ROPE_LINEAR ? (double)freq / factor : freq;
+    }
+}
 
-    
+int ring_window(RunState* s, int pos) {
+    // how many positions the token at pos attends to on the ring, 0 for all of 0..pos as usual.
+    // until the chunk being forwarded wraps around, nothing has been overwritten. after that it
+    // is the sinks and the latest positions, less those the later tokens of the chunk overwrite
+    if (s->ring_len == 0 || s->ring_end < s->ring_len) { return 0; }
+    return s->ring_len - (s->ring_end - pos);
+}
 
-    // the current position we are in
-    long start = time_in_ms();
-    int next;
-    int token = 1; // 1 = BOS token in Llama-2 sentencepiece
-    int pos = 0;
-    printf("<s>\n"); // explicit print the initial BOS token (=1), stylistically symmetric
+int attention_span(RunState* s, int tpos, int* shift) {
+    // how many timesteps the token at tpos attends to: 0..tpos inclusively, or once the ring has
+    // wrapped the sinks and then its ring_window. att[i] past the sinks is timestep i + shift
+    int n = ring_window(s, tpos);
+    if (n == 0) { *shift = 0; return tpos + 1; }
+    *shift = tpos - n + 1;
+    return n;
+}
+
+int attended_position(RunState* s, int i, int shift) {
+    // the timestep of att[i], for attention_span's shift
+    return i < s->n_sink ? i : i + shift;
+}
+
+void attention_head(Config* p, RunState* s, int l, int* slots, int* pos, int th) {
+    // attention of head th % n_heads of token th / n_heads over its sequence in the kv cache, into s->xb.
+    // with the ring wrapped, a token attends to the sinks, with its q_sink query, and to the latest
+    // ring_window - n_sink positions, keys all keeping their RoPE at their own position
+    int t = th / p->n_heads;
+    int h = th % p->n_heads;
+    int kv_mul = p->n_heads / p->n_kv_heads; // integer multiplier of the kv sharing in multiquery
+    int head_size = p->dim / p->n_heads;
+    // get the query vector for this head
+    float* q = s->q + t * p->dim + h * head_size;
+    // attention scores for this head
+    float* att = s->att + th * p->seq_len;
+    // the attended timesteps: 0..pos[t] inclusively, or the sinks and a window once the ring wrapped
+    int shift;
+    int n = attention_span(s, pos[t], &shift);
+    float* qs = shift > 0 ? s->q_sink + t * p->dim + h * head_size : q; // the query for the sinks
+    for (int i = 0; i < n; i++) {
+        // get the key vector for this head and at this timestep. each group of kv_mul query
+        // heads shares one kv head
+        float* k = (float*)s->key_cache + kv_offset(p, s, slots[t], attended_position(s, i, shift), l, h / kv_mul);
+        // calculate the attention score as the dot product of q and k
+        float score = dot(i < s->n_sink ? qs : q, k, head_size);
+        score /= sqrtf(head_size);
+        // save the score to the attention buffer
+        att[i] = score;
+    }
+
+    // softmax the scores to get attention weights
+    softmax(att, n);
+
+    // weighted sum of the values, store back into xb. accumulate one timestep
+    // at a time so that the value vectors are streamed contiguously
+    float* xb = s->xb + t * p->dim + h * head_size;
+    memset(xb, 0, head_size * sizeof(float));
+    for (int i = 0; i < n; i++) {
+        float* v = (float*)s->value_cache + kv_offset(p, s, slots[t], attended_position(s, i, shift), l, h / kv_mul);
+        float a = att[i];
+        for (int j = 0; j < head_size; j++) {
+            xb[j] += a * v[j];
+        }
+    }
+}
+
+void attention_head_half(Config* p, RunState* s, int l, int* slots, int* pos, int th) {
+    // attention_head over a 16-bit kv cache, widened to fp32 as it is read. kept apart so that
+    // the attention fine-tuning differentiates stays plain fp32
+    int t = th / p->n_heads;
+    int h = th % p->n_heads;
+    int bf16 = s->kv_dtype == DTYPE_BF16;
+    int kv_mul = p->n_heads / p->n_kv_heads;
+    int head_size = p->dim / p->n_heads;
+    float* q = s->q + t * p->dim + h * head_size;
+    float* att = s->att + th * p->seq_len;
+    int shift;
+    int n = attention_span(s, pos[t], &shift);
+    float* qs = shift > 0 ? s->q_sink + t * p->dim + h * head_size : q;
+    for (int i = 0; i < n; i++) {
+        uint16_t* k = (uint16_t*)s->key_cache + kv_offset(p, s, slots[t], attended_position(s, i, shift), l, h / kv_mul);
+        att[i] = dot_half(k, i < s->n_sink ? qs : q, head_size, bf16) / sqrtf(head_size);
+    }
+    softmax(att, n);
+    float* xb = s->xb + t * p->dim + h * head_size;
+    memset(xb, 0, head_size * sizeof(float));
+    for (int i = 0; i < n; i++) {
+        uint16_t* v = (uint16_t*)s->value_cache + kv_offset(p, s, slots[t], attended_position(s, i, shift), l, h / kv_mul);
+        float a = att[i];
+        for (int j = 0; j < head_size; j++) {
+            xb[j] += a * half_to_float(v[j], bf16);
+        }
+    }
+}
+
+void attention(Config* p, RunState* s, int l, int* slots, int* pos, int nt) {
+    // multihead attention of nt tokens over the kv cache, output into s->xb. token t belongs
+    // to the sequence in kv slot slots[t] and is at position pos[t] of it. each token attends
+    // causally over its own sequence, up to and including its own position
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int head_size = p->dim / p->n_heads;
+
+    // save the keys,values of all nt tokens to our kv cache first, so that tokens of the same
+    // sequence see each other
+    for (int t = 0; t < nt; t++) {
+        for (int h = 0; h < p->n_kv_heads; h++) {
+            size_t hoff = kv_offset(p, s, slots[t], pos[t], l, h);
+            memcpy((float*)s->key_cache + hoff, s->k + t * kv_dim + h * head_size, head_size*sizeof(*s->k));
+            memcpy((float*)s->value_cache + hoff, s->v + t * kv_dim + h * head_size, head_size*sizeof(*s->v));
+        }
+    }
+    
+    // multihead attention. iterate over all heads of all tokens
+    #pragma omp parallel for
+    for (int th = 0; th < nt * p->n_heads; th++) {
+        attention_head(p, s, l, slots, pos, th);
+    }
+}
+
+void transformer_layer(int l, float* x, int* slots, int* pos, int nt, Config* __restrict__ p,
+                       RunState* __restrict__ s, TransformerWeights* __restrict__ w, LoraWeights* lw) {
+    // layer l of the forward pass of transformer_rows, in place on the nt rows of x. with the
+    // adapters of lw if not NULL
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int hidden_dim =  p->hidden_dim;
+    int head_size = dim / p->n_heads;
+    int r = lw ? lw->rank : 0;
+    size_t la = (size_t)l * r * dim; // layer offset of the A's that take dim inputs
+
+    // attention rmsnorm
+    for (int t = 0; t < nt; t++) {
+        rmsnorm(s->xb + t * dim, x + t * dim, w->rms_att_weight + l*dim, dim);
+    }
+
+    // qkv matmuls for these positions
+    matmul_qkv(s->q, s->k, s->v, s->xb, w->wq + l*dim*dim, w->wk + l*dim*kv_dim, w->wv + l*dim*kv_dim,
+               dim, dim, kv_dim, nt);
+    if (r > 0) {
+        lora_matmul(s->q, s->xb, lw->wq_a + la, lw->wq_b + la, s->lora_h, dim, dim, r, lw->scale, nt);
+        lora_matmul(s->k, s->xb, lw->wk_a + la, lw->wk_b + (size_t)l * kv_dim * r, s->lora_h, dim, kv_dim, r, lw->scale, nt);
+        lora_matmul(s->v, s->xb, lw->wv_a + la, lw->wv_b + (size_t)l * kv_dim * r, s->lora_h, dim, kv_dim, r, lw->scale, nt);
+    }
+
+    // RoPE with the "pos[t]" row of freq_cis_real and freq_cis_imag
+    for (int t = 0; t < nt; t++) {
+        rope(p, s->q + t * dim, s->k + t * kv_dim,
+             w->freq_cis_real + pos[t] * head_size / 2, w->freq_cis_imag + pos[t] * head_size / 2);
+    }
+
+    // cache the keys/values and attend over 0..pos[t], into xb
+    attention(p, s, l, slots, pos, nt);
+
+    // final matmul to get the output of the attention
+    matmul(s->xb2, s->xb, w->wo + l*dim*dim, dim, dim, nt);
+    if (r > 0) { lora_matmul(s->xb2, s->xb, lw->wo_a + la, lw->wo_b + la, s->lora_h, dim, dim, r, lw->scale, nt); }
+
+    // residual connection back into x
+    accum(x, s->xb2, nt * dim);
+
+    // ffn rmsnorm
+    for (int t = 0; t < nt; t++) {
+        rmsnorm(s->xb + t * dim, x + t * dim, w->rms_ffn_weight + l*dim, dim);
+    }
+
+    // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
+    // first calculate F.silu(self.w1(x)) * self.w3(x), in one fused pass
+    if (r > 0 && lw->ffn) {
+        float* h1 = s->lora_h;
+        float* h3 = s->lora_h + MAX_CHUNK * MAX_LORA_RANK;
+        size_t lb = (size_t)l * hidden_dim * r;
+        matmul(h1, s->xb, lw->w1_a + la, dim, r, nt);
+        matmul(h3, s->xb, lw->w3_a + la, dim, r, nt);
+        matmul_swiglu_lora(s->hb, s->xb, w->w1 + l*dim*hidden_dim, w->w3 + l*dim*hidden_dim, lw->w1_b + lb, lw->w3_b + lb,
+                           h1, h3, r, lw->scale, dim, hidden_dim, nt);
+    } else {
+        matmul_swiglu(s->hb, s->xb, w->w1 + l*dim*hidden_dim, w->w3 + l*dim*hidden_dim, dim, hidden_dim, nt);
+    }
+
+    // final matmul to get the output of the ffn
+    matmul(s->xb, s->hb, w->w2 + l*dim*hidden_dim, hidden_dim, dim, nt);
+    if (r > 0 && lw->ffn) {
+        lora_matmul(s->xb, s->hb, lw->w2_a + (size_t)l * r * hidden_dim, lw->w2_b + la, s->lora_h, hidden_dim, dim, r, lw->scale, nt);
+    }
+
+    // residual connection
+    accum(x, s->xb, nt * dim);
+}
+
+int logit_rows(int* slots, int nt, int all_logits, int* rows) {
+    // which of the nt rows of a forward pass get logits: all of them with all_logits, else the last
+    // row of each sequence. returns how many, their indices go to rows
+    int n = 0;
+    for (int t = 0; t < nt; t++) {
+        if (!all_logits && t + 1 < nt && slots[t + 1] == slots[t]) { continue; }
+        rows[n++] = t;
+    }
+    return n;
+}
+
+void transformer_rows(int* tokens, int* slots, int* pos, int nt, int all_logits, Config* __restrict__ p,
+                      RunState* __restrict__ s, TransformerWeights* __restrict__ w, LoraWeights* lw) {
+    // forward nt (<= MAX_CHUNK) tokens, token t at position pos[t] of the sequence in kv slot slots[t].
+    // every matmul is done for all nt tokens at once, so the weights are streamed from memory once
+    // per pass instead of once per token. the tokens of one sequence must be consecutive rows, in
+    // order, and only the last row of each sequence gets logits: the k-th sequence's go to
+    // s->logits + k * vocab_size. with all_logits every row t gets them, at s->logits + t * vocab_size.
+    // lw, if not NULL, are adapters on top of w
+    
+    // a few convenience variables
+    float *x = s->x;
+    int dim = p->dim;
+
+    // copy the token embeddings into x
+    for (int t = 0; t < nt; t++) {
+        float* content_row = &(w->token_embedding_table[tokens[t] * dim]);
+        memcpy(x + t * dim, content_row, dim*sizeof(*x));
+    }
+
+    // forward all the layers
+    for(int l = 0; l < p->n_layers; l++) {
+        transformer_layer(l, x, slots, pos, nt, p, s, w, lw);
+    }
+    
+    // final rmsnorm and classifier into logits, for the last token of each sequence.
+    // these rows are gathered so the classifier is also a single pass over wcls
+    int rows[MAX_CHUNK];
+    int k = logit_rows(slots, nt, all_logits, rows);
+    for (int i = 0; i < k; i++) {
+        rmsnorm(s->xb + i * dim, x + rows[i] * dim, w->rms_final_weight, dim);
+    }
+    matmul(s->logits, s->xb, w->wcls, p->dim, p->vocab_size, k);
+}
+
+// ----------------------------------------------------------------------------
+// thread pool: persistent workers that run whole forward passes together with the caller
+
+// times a thread checks for a barrier to open, or a new job, before it goes to sleep
+#define POOL_SPIN 100000
+// max number of numa nodes, so that a set of them fits an unsigned long
+#define MAX_NODES 64
+
+typedef struct {
+    int n_threads;       // including the calling thread, which is tid 0. 0 or 1: no workers
+    int spin;            // POOL_SPIN, or 0 if there are more threads than cpus to spin on
+    pthread_t* threads;  // (n_threads,) the workers, from tid 1
+    int n_nodes;         // numa nodes the threads are spread over, 1 without --numa
+    int* node;           // (n_threads,) numa node of each thread
+    void (*fn)(void* arg, int tid, int n_threads); // the job all threads run
+    void* arg;
+    int stop;
+    atomic_uint job;     // bumped to start a job
+    atomic_uint arrived; // threads that reached the current barrier
+    atomic_uint barrier; // bumped whenever all threads reached a barrier
+    atomic_int sleepers; // threads asleep on cond, waiting for job or barrier to move on
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} ThreadPool;
+
+ThreadPool pool; // set up by init_pool()
+
+void pool_wait(ThreadPool* tp, atomic_uint* word, unsigned old) {
+    // wait until *word moves on from old. spin first: inside a forward pass the other threads
+    // are a few microseconds away. between passes they may not come back for a while, so sleep
+    for (int i = 0; i < tp->spin; i++) {
+        if (atomic_load(word) != old) { return; }
+#ifdef HAVE_X86_SIMD
+        _mm_pause();
+#endif
+    }
+    pthread_mutex_lock(&tp->mutex);
+    atomic_fetch_add(&tp->sleepers, 1);
+    while (atomic_load(word) == old) { pthread_cond_wait(&tp->cond, &tp->mutex); }
+    atomic_fetch_sub(&tp->sleepers, 1);
+    pthread_mutex_unlock(&tp->mutex);
+}
+
+void pool_wake(ThreadPool* tp) {
+    // after moving on a word threads wait on, wake the ones that went to sleep on it. a thread
+    // counts itself in sleepers before its last look at the word, so it can't be missed
+    if (atomic_load(&tp->sleepers) > 0) {
+        pthread_mutex_lock(&tp->mutex);
+        pthread_cond_broadcast(&tp->cond);
+        pthread_mutex_unlock(&tp->mutex);
+    }
+}
+
+void pool_barrier(ThreadPool* tp) {
+    // wait until all threads of the job got here
+    if (tp->n_threads <= 1) { return; }
+    unsigned barrier = atomic_load(&tp->barrier);
+    if (atomic_fetch_add(&tp->arrived, 1) == (unsigned)tp->n_threads - 1) {
+        atomic_store(&tp->arrived, 0);
+        atomic_fetch_add(&tp->barrier, 1);
+        pool_wake(tp);
+    } else {
+        pool_wait(tp, &tp->barrier, barrier);
+    }
+}
+
+void pool_range(int n, int unit, int tid, int n_threads, int* start, int* end) {
+    // the static share of thread tid in n items, split in whole units. the same thread
+    // always gets the same items, e.g. the same weight rows of a matmul at every step
+    int units = n / unit;
+    *start = (int)((long)units * tid / n_threads) * unit;
+    *end = (int)((long)units * (tid + 1) / n_threads) * unit;
+}
+
+void* pool_worker(void* arg) {
+    int tid = (int)(intptr_t)arg;
+    unsigned job = 0;
+    while (1) {
+        pool_wait(&pool, &pool.job, job);
+        job++;
+        if (pool.stop) { return NULL; }
+        pool.fn(pool.arg, tid, pool.n_threads);
+        pool_barrier(&pool);
+    }
+}
+
+void pool_run(ThreadPool* tp, void (*fn)(void* arg, int tid, int n_threads), void* arg) {
+    // run fn on every thread, the calling one as tid 0, and return once they all finished
+    if (tp->n_threads <= 1) {
+        fn(arg, 0, 1);
+        return;
+    }
+    tp->fn = fn;
+    tp->arg = arg;
+    atomic_fetch_add(&tp->job, 1);
+    pool_wake(tp);
+    fn(arg, 0, tp->n_threads);
+    pool_barrier(tp);
+}
+
+int read_numa_nodes(int* cpu_node, int n_cpus) {
+    // the numa node of each cpu, from the cpulists in sysfs, e.g. "0-15,32-47". returns
+    // the number of nodes, 0 if the system doesn't say
+    int n_nodes = 0;
+    memset(cpu_node, 0, n_cpus * sizeof(int));
+    for (int node = 0; node < MAX_NODES; node++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* f = fopen(path, "r");
+        if (!f) { continue; }
+        int a, b;
+        while (fscanf(f, "%d", &a) == 1) {
+            b = a;
+            int sep = fgetc(f);
+            if (sep == '-' && fscanf(f, "%d", &b) == 1) { sep = fgetc(f); }
+            for (int c = a; c <= b && c < n_cpus; c++) { cpu_node[c] = node; }
+            if (sep != ',') { break; }
+        }
+        fclose(f);
+        n_nodes = node + 1;
+    }
+    return n_nodes;
+}
+
+void init_pool(int n_threads, int numa) {
+    // start the workers of the pool, n_threads <= 0 means one thread per cpu. each worker is
+    // pinned to its own cpu, so the weight rows it always handles stay in that cpu's caches.
+    // with numa the threads are spread over the nodes in proportion to their cpus, in tid
+    // order, so that the threads of a node handle neighbouring rows, see numa_place_weights().
+    // the calling thread is left alone, as OpenMP threads would inherit its affinity, except
+    // that with numa it is kept on its node
+    int n_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_cpus < 1) { n_cpus = 1; }
+    if (n_threads <= 0) { n_threads = n_cpus; }
+    pool.n_threads = n_threads;
+    pool.spin = n_threads <= n_cpus ? POOL_SPIN : 0;
+    pool.stop = 0;
+    pool.n_nodes = 1;
+    pool.node = calloc(n_threads, sizeof(int));
+    pool.threads = malloc(n_threads * sizeof(pthread_t));
+    int* cpu = malloc(n_threads * sizeof(int)); // the cpu each thread is pinned to, -1: none
+    if (!pool.node || !pool.threads || !cpu) {
+        printf("malloc failed!\n");
+        exit(1);
+    }
+    for (int tid = 0; tid < n_threads; tid++) { cpu[tid] = -1; }
+#ifdef __linux__
+    static int cpus[CPU_SETSIZE];     // the cpus we may run on, grouped by node
+    static int cpu_node[CPU_SETSIZE];
+    int node_start[MAX_NODES + 1], node_threads[MAX_NODES] = {0};
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        if (numa) {
+            pool.n_nodes = read_numa_nodes(cpu_node, CPU_SETSIZE);
+            if (pool.n_nodes < 1) {
+                fprintf(stderr, "no numa nodes found, placing memory as usual\n");
+                numa = 0;
+            }
+        }
+        if (!numa) {
+            pool.n_nodes = 1;
+            memset(cpu_node, 0, sizeof(cpu_node));
+        }
+        n_cpus = 0;
+        for (int node = 0; node < pool.n_nodes; node++) {
+            node_start[node] = n_cpus;
+            for (int c = 0; c < CPU_SETSIZE; c++) {
+                if (CPU_ISSET(c, &allowed) && cpu_node[c] == node) { cpus[n_cpus++] = c; }
+            }
+        }
+        node_start[pool.n_nodes] = n_cpus;
+        pool.spin = n_threads <= n_cpus ? POOL_SPIN : 0;
+        for (int tid = 0; tid < n_threads; tid++) {
+            // the node of the tid-th of n_threads spread evenly over the cpus, then its next cpu there
+            int node = cpu_node[cpus[(long)tid * n_cpus / n_threads]];
+            int size = node_start[node + 1] - node_start[node];
+            cpu[tid] = cpus[node_start[node] + node_threads[node]++ % size];
+            pool.node[tid] = node;
+        }
+        if (numa) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int c = node_start[pool.node[0]]; c < node_start[pool.node[0] + 1]; c++) { CPU_SET(cpus[c], &set); }
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+    }
+#endif
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    for (int tid = 1; tid < n_threads; tid++) {
+        if (pthread_create(&pool.threads[tid], NULL, pool_worker, (void*)(intptr_t)tid) != 0) {
+            printf("pthread_create failed!\n");
+            exit(1);
+        }
+#ifdef __linux__
+        if (cpu[tid] >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu[tid], &set);
+            pthread_setaffinity_np(pool.threads[tid], sizeof(set), &set);
+        }
+#endif
+    }
+    free(cpu);
+}
+
+void free_pool() {
+    if (pool.n_threads <= 1) { return; }
+    pool.stop = 1;
+    atomic_fetch_add(&pool.job, 1);
+    pool_wake(&pool);
+    for (int tid = 1; tid < pool.n_threads; tid++) { pthread_join(pool.threads[tid], NULL); }
+    free(pool.threads);
+    free(pool.node);
+    pthread_mutex_destroy(&pool.mutex);
+    pthread_cond_destroy(&pool.cond);
+}
+
+// ----------------------------------------------------------------------------
+// profiling: per-op timers of the forward pass and of fine-tuning, for --bench
+
+typedef enum {
+    OP_RMSNORM, OP_QKV, OP_ATTENTION, OP_QUANTIZE, OP_WO, OP_FFN, OP_W2, OP_CLASSIFIER, // forward_rows
+    OP_TRAIN_FORWARD, OP_TRAIN_BACKWARD, OP_TRAIN_REDUCE, OP_TRAIN_UPDATE, // a fine-tuning step
+    N_OPS
+} ProfileOp;
+
+const char* op_names[N_OPS] = { "rmsnorm", "qkv_rope", "attention", "quantize", "wo", "w1_w3_swiglu", "w2",
+                                "classifier", "train_forward", "train_backward", "train_reduce", "train_update" };
+
+typedef struct {
+    int on;              // the timers only run with --bench
+    long last;           // time of the last mark, in ns
+    long ns[N_OPS];      // wall clock time spent in each op
+    double bytes[N_OPS]; // the least memory traffic of each op: weights, kv cache, activations it must touch
+    double flops[N_OPS];
+} Profile;
+
+Profile profile;
+
+long time_in_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000L + time.tv_nsec;
+}
+
+void profile_mark(int tid, ProfileOp op) {
+    // the time since the last mark goes to op. in a pool job only tid 0 marks, right after a
+    // pool_barrier, when every thread finished the op
+    if (!profile.on || tid != 0) { return; }
+    long now = time_in_ns();
+    profile.ns[op] += now - profile.last;
+    profile.last = now;
+}
+
+void profile_start() {
+    // the next mark times from here
+    if (profile.on) { profile.last = time_in_ns(); }
+}
+
+void profile_reset() {
+    int on = profile.on;
+    memset(&profile, 0, sizeof(profile));
+    profile.on = on;
+    profile.last = time_in_ns();
+}
+
+void profile_count(Config* p, RunState* s, QuantizedWeights* qw, int* pos, int nt, int n_logits) {
+    // the bytes and flops of each op of one forward_rows, for GB/s and GFLOP/s. matmuls count
+    // their weights once however many rows go through them, attention the keys and values it reads
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    double hidden = p->hidden_dim;
+    double layers = p->n_layers;
+    int q8 = qw && qw->dtype == DTYPE_Q8_0;
+    double wb = q8 ? 1.0 + 4.0 / qw->group_size : qw ? 2.0 : 4.0; // bytes per weight, int8 ones with their scales
+    double kvb = kv_value_size(s->kv_dtype);
+    profile.bytes[OP_RMSNORM] += (2 * layers * nt + n_logits) * dim * 2 * sizeof(float);
+    profile.flops[OP_RMSNORM] += (2 * layers * nt + n_logits) * dim * 4;
+    profile.bytes[OP_QKV] += layers * ((double)dim * (dim + 2 * kv_dim) * wb + 2.0 * nt * kv_dim * kvb);
+    profile.flops[OP_QKV] += layers * 2.0 * nt * dim * (dim + 2 * kv_dim);
+    for (int t = 0; t < nt; t++) {
+        int shift;
+        int n = attention_span(s, pos[t], &shift);
+        profile.bytes[OP_ATTENTION] += layers * 2.0 * n * kv_dim * kvb;
+        profile.flops[OP_ATTENTION] += layers * 4.0 * n * dim;
+    }
+    if (q8) { profile.bytes[OP_QUANTIZE] += layers * nt * (dim + hidden) * (sizeof(float) + 1); }
+    profile.bytes[OP_WO] += layers * dim * dim * wb;
+    profile.flops[OP_WO] += layers * 2.0 * nt * dim * dim;
+    profile.bytes[OP_FFN] += layers * 2 * dim * hidden * wb;
+    profile.flops[OP_FFN] += layers * 4.0 * nt * dim * hidden;
+    profile.bytes[OP_W2] += layers * dim * hidden * wb;
+    profile.flops[OP_W2] += layers * 2.0 * nt * dim * hidden;
+    profile.bytes[OP_CLASSIFIER] += (double)p->vocab_size * dim * wb;
+    profile.flops[OP_CLASSIFIER] += 2.0 * n_logits * p->vocab_size * dim;
+}
+
+void profile_report(int op0, int op1, int runs, char* name) {
+    // ops op0..op1-1 per run, as a table on stderr and as the "ops" of the json object on
+    // stdout that name started printing
+    long total = 0;
+    for (int i = op0; i < op1; i++) { total += profile.ns[i]; }
+    fprintf(stderr, "%-16s %10s %7s %9s %9s\n", name, "ms/run", "share", "GB/s", "GFLOP/s");
+    printf("\"ops\": {");
+    for (int i = op0; i < op1; i++) {
+        double ms = profile.ns[i] / 1e6 / runs;
+        double gbs = profile.ns[i] > 0 ? profile.bytes[i] / profile.ns[i] : 0.0;
+        double gflops = profile.ns[i] > 0 ? profile.flops[i] / profile.ns[i] : 0.0;
+        fprintf(stderr, "%-16s %10.3f %6.1f%% %9.2f %9.2f\n", op_names[i], ms,
+                total > 0 ? 100.0 * profile.ns[i] / total : 0.0, gbs, gflops);
+        printf("%s\"%s\": {\"ms\": %.6f, \"gb_s\": %.3f, \"gflop_s\": %.3f}", i > op0 ? ", " : "",
+               op_names[i], ms, gbs, gflops);
+    }
+    printf("}");
+}
+
+// ----------------------------------------------------------------------------
+// the forward pass for inference, with every thread of the pool running all of it
+
+typedef struct {
+    Config* p;
+    RunState* s;
+    TransformerWeights* w;
+    QuantizedWeights* qw; // the int8 weights if not NULL, else w
+    int* tokens;
+    int* slots;
+    int* pos;
+    int nt;
+    int n_logits;               // number of rows that get logits
+    int logit_rows[MAX_CHUNK];  // and which rows those are
+} ForwardJob;
+
+float forward_dot(ForwardJob* j, float* w, QuantizedTensor* qw, size_t row, float* x, int t, int n) {
+    // the weight row starting `row` values into w, or into qw for int8 or 16-bit weights, times
+    // row t of the (nt, n) activations x. for int8 weights x was quantized into s->xq first
+    if (qw && j->qw->dtype != DTYPE_Q8_0) {
+        return dot_half(qw->h + row, x + (size_t)t * n, n, j->qw->dtype == DTYPE_BF16);
+    }
+    if (qw) {
+        int gs = j->qw->group_size;
+        return dot_q8(j->s->xq + (size_t)t * n, j->s->xq_s + (size_t)t * n / gs, qw, row, n, gs);
+    }
+    return dot(w + row, x + (size_t)t * n, n);
+}
+
+void forward_quantize(ForwardJob* j, float* x, int n, int t0, int t1) {
+    // rows t0..t1 of the (nt, n) activations x into s->xq, for forward_dot() with int8 weights
+    if (!j->qw || j->qw->dtype != DTYPE_Q8_0) { return; }
+    int gs = j->qw->group_size;
+    quantize(j->s->xq + (size_t)t0 * n, j->s->xq_s + (size_t)t0 * n / gs, x + (size_t)t0 * n, (t1 - t0) * n, gs);
+}
+
+void forward_worker(void* arg, int tid, int n_threads) {
+    // one thread's part of the forward pass of a ForwardJob. the output rows of every matmul are
+    // split statically over the threads, and each thread finishes its rows on the spot: RoPE,
+    // writing the kv cache and the residual connections need nothing but the row itself. so the
+    // threads only wait for each other where a stage needs whole rows of the previous one
+    ForwardJob* j = arg;
+    Config* p = j->p;
+    RunState* s = j->s;
+    TransformerWeights* w = j->w;
+    QuantizedWeights* qw = j->qw;
+    if (qw) { w = NULL; }
+    int q8 = qw && qw->dtype == DTYPE_Q8_0; // 16-bit weights take the fp32 activations as they are
+    float *x = s->x;
+    int nt = j->nt;
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int hidden_dim =  p->hidden_dim;
+    int head_size = dim / p->n_heads;
+    size_t ldim = (size_t)dim * dim, lkv = (size_t)dim * kv_dim, lhid = (size_t)dim * hidden_dim;
+    // the weights that are fp32 in all kinds of checkpoints
+    float* rms_att_weight = qw ? qw->rms_att_weight : w->rms_att_weight;
+    float* rms_ffn_weight = qw ? qw->rms_ffn_weight : w->rms_ffn_weight;
+    float* rms_final_weight = qw ? qw->rms_final_weight : w->rms_final_weight;
+    float* freq_cis_real = qw ? qw->freq_cis_real : w->freq_cis_real;
+    float* freq_cis_imag = qw ? qw->freq_cis_imag : w->freq_cis_imag;
+    int t0, t1, i0, i1;
+    pool_range(nt, 1, tid, n_threads, &t0, &t1); // this thread's tokens, for the per-token stages
+
+    // copy the token embeddings into x
+    for (int t = t0; t < t1; t++) {
+        size_t row = (size_t)j->tokens[t] * dim;
+        if (qw && !q8) {
+            dequantize_half(x + t * dim, qw->token_embedding_table.h + row, dim, qw->dtype == DTYPE_BF16);
+        } else if (qw) {
+            dequantize(x + t * dim, qw->token_embedding_table.q + row,
+                       qw->token_embedding_table.s + row / qw->group_size, dim, qw->group_size);
+        } else {
+            memcpy(x + t * dim, w->token_embedding_table + row, dim*sizeof(*x));
+        }
+    }
+
+    // forward all the layers
+    for(int l = 0; l < p->n_layers; l++) {
+        // attention rmsnorm
+        for (int t = t0; t < t1; t++) {
+            rmsnorm(s->xb + t * dim, x + t * dim, rms_att_weight + l*dim, dim);
+        }
+        forward_quantize(j, s->xb, dim, t0, t1);
+        pool_barrier(&pool);
+        profile_mark(tid, OP_RMSNORM);
+
+        // the rows of q, k and v, in pairs so that RoPE can rotate each pair right away. q goes
+        // to s->q, k and v straight into the kv cache
+        pool_range(dim + 2 * kv_dim, 2, tid, n_threads, &i0, &i1);
+        for (int i = i0; i < i1; i += 2) {
+            int m = i < dim ? 0 : i < dim + kv_dim ? 1 : 2; // q, k or v
+            int e = m == 0 ? i : m == 1 ? i - dim : i - dim - kv_dim; // row of that matrix
+            float* wm = !w ? NULL : m == 0 ? w->wq : m == 1 ? w->wk : w->wv;
+            QuantizedTensor* qm = !qw ? NULL : m == 0 ? &qw->wq : m == 1 ? &qw->wk : &qw->wv;
+            size_t row = (m == 0 ? l * ldim : l * lkv) + (size_t)e * dim;
+            int h = e / head_size; // the head, and where in it e is
+            int hi = e % head_size;
+            for (int t = 0; t < nt; t++) {
+                float v0 = forward_dot(j, wm, qm, row, s->xb, t, dim);
+                float v1 = forward_dot(j, wm, qm, row + dim, s->xb, t, dim);
+                if (m == 0 && ring_window(s, j->pos[t]) > 0) {
+                    // the query for the sinks, as if at the last position its window attends over
+                    size_t r = (size_t)(ring_window(s, j->pos[t]) - 1) * head_size / 2 + hi / 2;
+                    s->q_sink[t * dim + e] = v0;
+                    s->q_sink[t * dim + e + 1] = v1;
+                    rope_pair(&s->q_sink[t * dim + e], &s->q_sink[t * dim + e + 1], freq_cis_real[r], freq_cis_imag[r]);
+                }
+                if (m < 2) {
+                    // RoPE with the "pos[t]" row of freq_cis_real and freq_cis_imag, or past
+                    // the tables with the row forward_rows made in rope_rows
+                    int past = j->pos[t] >= p->seq_len;
+                    float* rows = s->rope_rows + t * head_size;
+                    float fcr = past ? rows[hi / 2] : freq_cis_real[j->pos[t] * head_size / 2 + hi / 2];
+                    float fci = past ? rows[head_size / 2 + hi / 2] : freq_cis_imag[j->pos[t] * head_size / 2 + hi / 2];
+                    rope_pair(&v0, &v1, fcr, fci);
+                }
+                if (m == 0) {
+                    s->q[t * dim + e] = v0;
+                    s->q[t * dim + e + 1] = v1;
+                } else {
+                    void* cache = m == 1 ? s->key_cache : s->value_cache;
+                    size_t off = kv_offset(p, s, j->slots[t], j->pos[t], l, h) + hi;
+                    if (s->kv_dtype == DTYPE_FP32) {
+                        ((float*)cache)[off] = v0;
+                        ((float*)cache)[off + 1] = v1;
+                    } else {
+                        ((uint16_t*)cache)[off] = float_to_half(v0, s->kv_dtype == DTYPE_BF16);
+                        ((uint16_t*)cache)[off + 1] = float_to_half(v1, s->kv_dtype == DTYPE_BF16);
+                    }
+                }
+            }
+        }
+        pool_barrier(&pool);
+        profile_mark(tid, OP_QKV);
+
+        // attend over 0..pos[t], all heads of all tokens split over the threads, into xb
+        pool_range(nt * p->n_heads, 1, tid, n_threads, &i0, &i1);
+        for (int th = i0; th < i1; th++) {
+            if (s->kv_dtype == DTYPE_FP32) {
+                attention_head(p, s, l, j->slots, j->pos, th);
+            } else {
+                attention_head_half(p, s, l, j->slots, j->pos, th);
+            }
+        }
+        pool_barrier(&pool);
+        profile_mark(tid, OP_ATTENTION);
+        if (q8) {
+            forward_quantize(j, s->xb, dim, t0, t1);
+            pool_barrier(&pool);
+            profile_mark(tid, OP_QUANTIZE);
+        }
+
+        // final matmul to get the output of the attention, with the residual connection back into x
+        pool_range(dim, 1, tid, n_threads, &i0, &i1);
+        for (int i = i0; i < i1; i++) {
+            for (int t = 0; t < nt; t++) {
+                x[t * dim + i] += forward_dot(j, w ? w->wo : NULL, qw ? &qw->wo : NULL, l*ldim + (size_t)i * dim, s->xb, t, dim);
+            }
+        }
+        pool_barrier(&pool);
+        profile_mark(tid, OP_WO);
+
+        // ffn rmsnorm
+        for (int t = t0; t < t1; t++) {
+            rmsnorm(s->xb + t * dim, x + t * dim, rms_ffn_weight + l*dim, dim);
+        }
+        forward_quantize(j, s->xb, dim, t0, t1);
+        pool_barrier(&pool);
+        profile_mark(tid, OP_RMSNORM);
+
+        // self.w2(F.silu(self.w1(x)) * self.w3(x)), first F.silu(self.w1(x)) * self.w3(x)
+        pool_range(hidden_dim, 1, tid, n_threads, &i0, &i1);
+        for (int i = i0; i < i1; i++) {
+            size_t row = l*lhid + (size_t)i * dim;
+            for (int t = 0; t < nt; t++) {
+                float h1 = forward_dot(j, w ? w->w1 : NULL, qw ? &qw->w1 : NULL, row, s->xb, t, dim);
+                float h3 = forward_dot(j, w ? w->w3 : NULL, qw ? &qw->w3 : NULL, row, s->xb, t, dim);
+                s->hb[(size_t)t * hidden_dim + i] = h1 * (1.0f / (1.0f + expf(-h1))) * h3;
+            }
+        }
+        pool_barrier(&pool);
+        profile_mark(tid, OP_FFN);
+        if (q8) {
+            forward_quantize(j, s->hb, hidden_dim, t0, t1);
+            pool_barrier(&pool);
+            profile_mark(tid, OP_QUANTIZE);
+        }
+
+        // then self.w2, with the residual connection
+        pool_range(dim, 1, tid, n_threads, &i0, &i1);
+        for (int i = i0; i < i1; i++) {
+            for (int t = 0; t < nt; t++) {
+                x[t * dim + i] += forward_dot(j, w ? w->w2 : NULL, qw ? &qw->w2 : NULL, l*lhid + (size_t)i * hidden_dim, s->hb, t, hidden_dim);
+            }
+        }
+        pool_barrier(&pool);
+        profile_mark(tid, OP_W2);
+    }
+
+    // final rmsnorm of the rows that get logits, gathered so the classifier streams wcls once
+    pool_range(j->n_logits, 1, tid, n_threads, &i0, &i1);
+    for (int k = i0; k < i1; k++) {
+        rmsnorm(s->xb + k * dim, x + j->logit_rows[k] * dim, rms_final_weight, dim);
+    }
+    forward_quantize(j, s->xb, dim, i0, i1);
+    pool_barrier(&pool);
+    profile_mark(tid, OP_RMSNORM);
+
+    // classifier into logits
+    pool_range(p->vocab_size, 1, tid, n_threads, &i0, &i1);
+    for (int i = i0; i < i1; i++) {
+        for (int k = 0; k < j->n_logits; k++) {
+            s->logits[(size_t)k * p->vocab_size + i] = forward_dot(j, w ? w->wcls : NULL, qw ? &qw->wcls : NULL,
+                                                                   (size_t)i * dim, s->xb, k, dim);
+        }
+    }
+}
+
+void forward_rows(int* tokens, int* slots, int* pos, int nt, int all_logits, Config* p, RunState* s,
+                  TransformerWeights* w, QuantizedWeights* qw) {
+    // the forward pass of transformer_rows(), with the int8 or 16-bit weights qw if not NULL, else
+    // w, run by all threads of the pool. the same rows get logits, in the same place.
+    // transformer_rows() stays the version that fine-tuning differentiates, Enzyme can't see
+    // through the pool, so only it takes adapters: for inference they are merged into the weights.
+    // check_forward() keeps the two in agreement
+    ForwardJob j = { .p = p, .s = s, .w = w, .qw = qw, .tokens = tokens, .slots = slots, .pos = pos, .nt = nt };
+    profile_start();
+    j.n_logits = logit_rows(slots, nt, all_logits, j.logit_rows);
+    // RoPE rows for the positions past the tables, the ring generating past seq_len. in double,
+    // the angles of late positions are too large to take in float
+    int half = p->dim / p->n_heads / 2;
+    s->ring_end = 0;
+    for (int t = 0; t < nt; t++) {
+        if (pos[t] > s->ring_end) { s->ring_end = pos[t]; }
+        if (pos[t] < p->seq_len) { continue; }
+        for (int i = 0; i < half; i++) {
+            double val = pos[t] * s->rope_freq[i];
+            s->rope_rows[t * 2 * half + i] = (float)cos(val);
+            s->rope_rows[t * 2 * half + half + i] = (float)sin(val);
+        }
+    }
+    pool_run(&pool, forward_worker, &j);
+    if (profile.on) {
+        profile_mark(0, OP_CLASSIFIER);
+        profile_count(p, s, qw, pos, nt, j.n_logits);
+    }
+}
+
+void forward_chunk(int* tokens, int nt, int pos, Config* p, RunState* s, TransformerWeights* w, QuantizedWeights* qw) {
+    // forward nt (<= MAX_CHUNK) consecutive tokens of the sequence in slot 0, starting at position pos.
+    // logits are only computed for the last token
+    int slots[MAX_CHUNK];
+    int positions[MAX_CHUNK];
+    for (int t = 0; t < nt; t++) {
+        slots[t] = 0;
+        positions[t] = pos + t;
+    }
+    forward_rows(tokens, slots, positions, nt, 0, p, s, w, qw);
+}
+
+// ----------------------------------------------------------------------------
+// prefaulting: reading the whole checkpoint in before the first token needs it
+
+void prefault_worker(void* arg, int tid, int n_threads) {
+    // touch every page of this thread's share of the mapping
+    char** range = arg;
+    long page = sysconf(_SC_PAGESIZE);
+    long n_pages = (range[1] - range[0] + page - 1) / page;
+    int p0, p1;
+    pool_range((int)n_pages, 1, tid, n_threads, &p0, &p1);
+    volatile char sink = 0;
+    for (long i = p0; i < p1; i++) { sink += range[0][i * page]; }
+    (void)sink;
+}
+
+void prefault(void* data, long size) {
+    // start the readahead of the whole mapping, then fault it in on all threads of the pool at
+    // once, which overlaps the page faults instead of taking them one by one in the first token
+    madvise(data, size, MADV_WILLNEED);
+    char* range[2] = { data, (char*)data + size };
+    pool_run(&pool, prefault_worker, range);
+}
+
+// ----------------------------------------------------------------------------
+// numa: every weight row in the memory of the node whose threads multiply with it
+
+int numa_bind(char* start, char* end, int mode, unsigned long nodes) {
+    // set the memory policy of the pages in start..end, rounded to the nearest page boundaries
+    // so that neighbouring ranges don't overlap. the pages get placed when they are first touched
+#ifdef __linux__
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t a = ((uintptr_t)start + page / 2) / page * page;
+    uintptr_t b = ((uintptr_t)end + page / 2) / page * page;
+    if (a >= b) { return 0; }
+    return syscall(SYS_mbind, a, b - a, mode, &nodes, MAX_NODES, 0) == 0 ? 0 : 1;
+#else
+    return 1;
+#endif
+}
+
+int numa_bind_rows(void* tensor, size_t row_bytes, int first, int n_rows, int total, int unit) {
+    // bind the n_rows rows of tensor, which are items first..first + n_rows of a pool_range()
+    // split of total items in units of unit, to the node of the thread that gets each of them
+    int failed = 0;
+    for (int tid = 0; tid < pool.n_threads; tid++) {
+        int i0, i1;
+        pool_range(total, unit, tid, pool.n_threads, &i0, &i1);
+        i0 = i0 < first ? 0 : i0 - first;
+        i1 = i1 > first + n_rows ? n_rows : i1 - first;
+        if (i0 >= i1) { continue; }
+        failed |= numa_bind((char*)tensor + i0 * row_bytes, (char*)tensor + i1 * row_bytes, MPOL_BIND, 1UL << pool.node[tid]);
+    }
+    return failed;
+}
+
+void* numa_rebase(void* ptr, char* from, char* to, size_t size) {
+    // ptr into from..from + size, moved to the same offset from to. anything else stays
+    return (char*)ptr >= from && (char*)ptr < from + size ? to + ((char*)ptr - from) : ptr;
+}
+
+void numa_rebase_tensor(QuantizedTensor* t, char* from, char* to, size_t size) {
+    t->q = numa_rebase(t->q, from, to, size);
+    t->s = numa_rebase(t->s, from, to, size);
+    t->h = numa_rebase(t->h, from, to, size);
+}
+
+int numa_bind_tensor(QuantizedTensor* t, QuantizedWeights* qw, size_t off, int n, int first, int n_rows, int total, int unit) {
+    // numa_bind_rows() for the (n_rows, n) rows of t from value off on, int8 ones with their scales
+    if (qw->dtype != DTYPE_Q8_0) { return numa_bind_rows(t->h + off, n * sizeof(uint16_t), first, n_rows, total, unit); }
+    int gs = qw->group_size;
+    return numa_bind_rows(t->q + off, n, first, n_rows, total, unit)
+         | numa_bind_rows(t->s + off / gs, n / gs * sizeof(float), first, n_rows, total, unit);
+}
+
+int numa_place_weights(Config* p, TransformerWeights* w, QuantizedWeights* qw, float** data, long file_size) {
+    // replace the mmap of the checkpoint data with an anonymous copy, with each weight row
+    // bound to the node of the pool thread that computes with it in forward_worker(), so each
+    // node only streams its own memory. everything else, e.g. the token embeddings that all
+    // threads read, is interleaved over the nodes. w or qw (int8 or 16-bit if not NULL) is moved along
+    if (pool.n_nodes <= 1) { return 0; }
+    char* from = (char*)*data;
+    char* to = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (to == MAP_FAILED) { printf("mmap failed!\n"); return 1; }
+    if (qw) {
+        numa_rebase_tensor(&qw->token_embedding_table, from, to, file_size);
+        qw->rms_att_weight = numa_rebase(qw->rms_att_weight, from, to, file_size);
+        qw->rms_ffn_weight = numa_rebase(qw->rms_ffn_weight, from, to, file_size);
+        numa_rebase_tensor(&qw->wq, from, to, file_size);
+        numa_rebase_tensor(&qw->wk, from, to, file_size);
+        numa_rebase_tensor(&qw->wv, from, to, file_size);
+        numa_rebase_tensor(&qw->wo, from, to, file_size);
+        numa_rebase_tensor(&qw->w1, from, to, file_size);
+        numa_rebase_tensor(&qw->w2, from, to, file_size);
+        numa_rebase_tensor(&qw->w3, from, to, file_size);
+        qw->rms_final_weight = numa_rebase(qw->rms_final_weight, from, to, file_size);
+        qw->freq_cis_real = numa_rebase(qw->freq_cis_real, from, to, file_size);
+        qw->freq_cis_imag = numa_rebase(qw->freq_cis_imag, from, to, file_size);
+        numa_rebase_tensor(&qw->wcls, from, to, file_size);
+    } else {
+        w->token_embedding_table = numa_rebase(w->token_embedding_table, from, to, file_size);
+        w->rms_att_weight = numa_rebase(w->rms_att_weight, from, to, file_size);
+        w->rms_ffn_weight = numa_rebase(w->rms_ffn_weight, from, to, file_size);
+        w->wq = numa_rebase(w->wq, from, to, file_size);
+        w->wk = numa_rebase(w->wk, from, to, file_size);
+        w->wv = numa_rebase(w->wv, from, to, file_size);
+        w->wo = numa_rebase(w->wo, from, to, file_size);
+        w->w1 = numa_rebase(w->w1, from, to, file_size);
+        w->w2 = numa_rebase(w->w2, from, to, file_size);
+        w->w3 = numa_rebase(w->w3, from, to, file_size);
+        w->rms_final_weight = numa_rebase(w->rms_final_weight, from, to, file_size);
+        w->freq_cis_real = numa_rebase(w->freq_cis_real, from, to, file_size);
+        w->freq_cis_imag = numa_rebase(w->freq_cis_imag, from, to, file_size);
+        w->wcls = numa_rebase(w->wcls, from, to, file_size);
+    }
+
+    unsigned long nodes = 0;
+    for (int tid = 0; tid < pool.n_threads; tid++) { nodes |= 1UL << pool.node[tid]; }
+    int failed = numa_bind(to, to + file_size, MPOL_INTERLEAVE, nodes);
+    // the same splits as in forward_worker(): the rows of q, k and v in pairs over all three,
+    // wo, w1, w3 and w2 over their rows, and wcls over the vocab. int8 rows go along with their scales
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int hidden_dim = p->hidden_dim;
+    int qkv = dim + 2 * kv_dim;
+    for (int l = 0; l < p->n_layers; l++) {
+        size_t ldim = (size_t)l * dim * dim, lkv = (size_t)l * dim * kv_dim, lhid = (size_t)l * dim * hidden_dim;
+        if (qw) {
+            failed |= numa_bind_tensor(&qw->wq, qw, ldim, dim, 0, dim, qkv, 2);
+            failed |= numa_bind_tensor(&qw->wk, qw, lkv, dim, dim, kv_dim, qkv, 2);
+            failed |= numa_bind_tensor(&qw->wv, qw, lkv, dim, dim + kv_dim, kv_dim, qkv, 2);
+            failed |= numa_bind_tensor(&qw->wo, qw, ldim, dim, 0, dim, dim, 1);
+            failed |= numa_bind_tensor(&qw->w1, qw, lhid, dim, 0, hidden_dim, hidden_dim, 1);
+            failed |= numa_bind_tensor(&qw->w3, qw, lhid, dim, 0, hidden_dim, hidden_dim, 1);
+            failed |= numa_bind_tensor(&qw->w2, qw, lhid, hidden_dim, 0, dim, dim, 1);
+        } else {
+            size_t row = dim * sizeof(float);
+            failed |= numa_bind_rows(w->wq + ldim, row, 0, dim, qkv, 2);
+            failed |= numa_bind_rows(w->wk + lkv, row, dim, kv_dim, qkv, 2);
+            failed |= numa_bind_rows(w->wv + lkv, row, dim + kv_dim, kv_dim, qkv, 2);
+            failed |= numa_bind_rows(w->wo + ldim, row, 0, dim, dim, 1);
+            failed |= numa_bind_rows(w->w1 + lhid, row, 0, hidden_dim, hidden_dim, 1);
+            failed |= numa_bind_rows(w->w3 + lhid, row, 0, hidden_dim, hidden_dim, 1);
+            failed |= numa_bind_rows(w->w2 + lhid, hidden_dim * sizeof(float), 0, dim, dim, 1);
+        }
+    }
+    if (qw) {
+        failed |= numa_bind_tensor(&qw->wcls, qw, 0, dim, 0, p->vocab_size, p->vocab_size, 1);
+    } else {
+        failed |= numa_bind_rows(w->wcls, dim * sizeof(float), 0, p->vocab_size, p->vocab_size, 1);
+    }
+    if (failed) { fprintf(stderr, "mbind failed, the weights may not be on the right numa nodes\n"); }
+
+    // the copy faults every page in, on the node its policy says
+    memcpy(to, from, file_size);
+    munmap(from, file_size);
+    *data = (float*)to;
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// sampling the next token from the logits
+
+uint32_t random_u32(uint64_t* state) {
+    // xorshift64*. the state is passed explicitly, so that every sequence can have its own
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (*state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+float random_f32(uint64_t* state) {
+    // uniform in [0,1)
+    return (random_u32(state) >> 8) / 16777216.0f;
+}
+
+int argmax(float* v, int n) {
+    // return argmax of v in elements 0..n
+    int max_i = 0;
+    float max_p = v[0];
+    for (int i = 1; i < n; i++) {
+        if (v[i] > max_p) {
+            max_i = i;
+            max_p = v[i];
+        }
+    }
+    return max_i;
+}
+
+typedef struct {
+    float prob;
+    int index;
+} ProbIndex; // a candidate token for sampling
+
+typedef struct {
+    int vocab_size;
+    float temperature; // 0.0 = (deterministic) argmax sampling
+    int topk;          // only sample from the topk most likely tokens, 0 = all of them
+    float topp;        // only sample from the most likely tokens that make up topp of the probability, 1 = all
+    ProbIndex* candidates; // (vocab_size,) scratch buffer
+} Sampler;
+
+void malloc_sampler(Sampler* s, int vocab_size, float temperature, int topk, float topp) {
+    s->vocab_size = vocab_size;
+    s->temperature = temperature;
+    s->topk = topk;
+    s->topp = topp;
+    s->candidates = malloc(vocab_size * sizeof(ProbIndex));
+    if (!s->candidates) {
+        printf("malloc failed!\n");
+        exit(1);
+    }
+}
+
+void free_sampler(Sampler* s) {
+    free(s->candidates);
+}
+
+void select_top(ProbIndex* a, int n, int k) {
+    // quickselect: reorder a so that its k largest entries come first, in no particular order
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        float pivot = a[lo + (hi - lo) / 2].prob;
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (a[i].prob > pivot) { i++; }
+            while (a[j].prob < pivot) { j--; }
+            if (i <= j) {
+                ProbIndex tmp = a[i];
+                a[i++] = a[j];
+                a[j--] = tmp;
+            }
+        }
+        // now a[lo..j] >= pivot >= a[i..hi], and anything in between equals pivot
+        if (k - 1 <= j) { hi = j; }
+        else if (k - 1 >= i) { lo = i; }
+        else { break; }
+    }
+}
+
+int select_nucleus(ProbIndex* a, int n, float target, float* mass) {
+    // reorder a so that its first m entries are the most likely ones whose probabilities add up
+    // to target, with m as small as possible, and return m and their probability in mass. like
+    // select_top this is a partial selection in expected linear time, the nucleus isn't sorted
+    int lo = 0, hi = n;
+    float acc = 0.0f; // probability of a[0..lo), which are all more likely than a[lo..n)
+    while (lo < hi) {
+        float pivot = a[lo + (hi - lo) / 2].prob;
+        // three way partition of a[lo..hi) into > pivot, == pivot, < pivot
+        int gt = lo, i = lo, lt = hi;
+        float mass_gt = 0.0f;
+        while (i < lt) {
+            ProbIndex tmp = a[i];
+            if (tmp.prob > pivot) {
+                mass_gt += tmp.prob;
+                a[i++] = a[gt];
+                a[gt++] = tmp;
+            } else if (tmp.prob < pivot) {
+                a[i] = a[--lt];
+                a[lt] = tmp;
+            } else {
+                i++;
+            }
+        }
+        if (acc + mass_gt >= target) { hi = gt; continue; }
+        acc += mass_gt;
+        if (acc + pivot * (lt - gt) >= target) {
+            // the nucleus ends among the tokens equal to the pivot
+            int m = gt + (int)ceilf((target - acc) / pivot);
+            if (m > lt) { m = lt; }
+            *mass = acc + pivot * (m - gt);
+            return m;
+        }
+        acc += pivot * (lt - gt);
+        lo = lt;
+    }
+    *mass = acc;
+    return lo;
+}
+
+int sampler_candidates(Sampler* s, float* logits, float* sum) {
+    // gather the tokens that can be sampled from the logits into s->candidates, with their
+    // probabilities left unnormalized, and return how many there are and their sum. top-k picks
+    // the candidates with a partial selection, so that only they go through the softmax. top-p
+    // needs the normalizer of that softmax, then narrows the candidates down to the nucleus with
+    // another partial selection
+    ProbIndex* c = s->candidates;
+    int n = s->vocab_size;
+    for (int i = 0; i < n; i++) {
+        c[i].prob = logits[i];
+        c[i].index = i;
+    }
+    if (s->topk > 0 && s->topk < n) {
+        select_top(c, n, s->topk);
+        n = s->topk;
+    }
+    // softmax with temperature over the candidates
+    float max_val = c[0].prob;
+    for (int i = 1; i < n; i++) {
+        if (c[i].prob > max_val) { max_val = c[i].prob; }
+    }
+    *sum = 0.0f;
+    for (int i = 0; i < n; i++) {
+        c[i].prob = expf((c[i].prob - max_val) / s->temperature);
+        *sum += c[i].prob;
+    }
+    if (s->topp < 1.0f) {
+        // keep the fewest most likely tokens that reach topp of the probability
+        n = select_nucleus(c, n, s->topp * *sum, sum);
+    }
+    return n;
+}
+
+int sample_logits(Sampler* s, float* logits, uint64_t* rng) {
+    // pick the next token from the logits
+    if (s->temperature == 0.0f) {
+        // greedy argmax sampling
+        return argmax(logits, s->vocab_size);
+    }
+    float sum;
+    int n = sampler_candidates(s, logits, &sum);
+    // sample index from the candidates, by walking their cdf
+    ProbIndex* c = s->candidates;
+    float r = random_f32(rng) * sum;
+    float cdf = 0.0f;
+    for (int i = 0; i < n; i++) {
+        cdf += c[i].prob;
+        if (r < cdf) {
+            return c[i].index;
+        }
+    }
+    return c[n - 1].index; // in case of rounding errors
+}
+
+void sampler_probs(Sampler* s, float* logits, float* probs) {
+    // the distribution sample_logits() draws from, as probabilities over the whole vocab
+    memset(probs, 0, s->vocab_size * sizeof(float));
+    if (s->temperature == 0.0f) {
+        probs[argmax(logits, s->vocab_size)] = 1.0f;
+        return;
+    }
+    float sum;
+    int n = sampler_candidates(s, logits, &sum);
+    for (int i = 0; i < n; i++) {
+        probs[s->candidates[i].index] = s->candidates[i].prob / sum;
+    }
+}
+
+int sample(float* probs, int n, uint64_t* rng) {
+    // sample index from probs, which don't have to be normalized, by walking their cdf.
+    // zero entries are never picked
+    float total = 0.0f;
+    for (int i = 0; i < n; i++) { total += probs[i]; }
+    float r = random_f32(rng) * total;
+    float cdf = 0.0f;
+    int last = 0;
+    for (int i = 0; i < n; i++) {
+        if (probs[i] <= 0.0f) { continue; }
+        cdf += probs[i];
+        last = i;
+        if (r < cdf) {
+            return i;
+        }
+    }
+    return last; // in case of rounding errors
+}
+
+// ----------------------------------------------------------------------------
+// fine-tuning: the loss that Enzyme differentiates
+
+float logits_loss(float* logits, int target, int vocab_size, float temperature) {
+    // apply the temperature to the logits
+    for (int q = 0; q < vocab_size; q++) { logits[q] /= temperature; }
+    // apply softmax to the logits to get the probabilities for next token
+    softmax(logits, vocab_size);
+    // https://github.com/keras-team/keras/blob/21c25fd38023a3783950c5577383ffe51a62f650/keras/backend_config.py#L34
+    return -log(logits[target] + 1e-7);
+}
+
+float sequence_loss(int* tokens, int nt, int pos, Config* __restrict__ config, RunState* __restrict__ s,
+                    TransformerWeights* __restrict__ w, LoraWeights* lw, float* losses, float temperature) {
+    // summed next token loss of nt consecutive positions of the sequence in slot 0, from pos on:
+    // tokens[t] is the input at position pos + t and tokens[t + 1] its target, so tokens has
+    // nt + 1 entries. the positions are forwarded MAX_CHUNK at a time with every matmul done
+    // for the whole chunk, so that one Enzyme call differentiates the whole window and its
+    // backward pass is matrix-matrix work too. the loss of each position goes to losses[t].
+    // lw are the adapters on top of w, rank 0 for none
+    int vocab_size = config->vocab_size;
+    int slots[MAX_CHUNK];
+    int positions[MAX_CHUNK];
+    float total = 0.0f;
+    for (int c = 0; c < nt; c += MAX_CHUNK) {
+        int n = nt - c < MAX_CHUNK ? nt - c : MAX_CHUNK;
+        for (int t = 0; t < n; t++) {
+            slots[t] = 0;
+            positions[t] = pos + c + t;
+        }
+        transformer_rows(tokens + c, slots, positions, n, 1, config, s, w, lw);
+        for (int t = 0; t < n; t++) {
+            losses[c + t] = logits_loss(s->logits + t * vocab_size, tokens[c + t + 1], vocab_size, temperature);
+            total += losses[c + t];
+        }
+    }
+    return total;
+}
+
+// gradient checkpointing: instead of differentiating the whole forward pass in one go, which
+// keeps every layer's activations for the backward pass, a plain forward pass keeps only the
+// input of each layer. the backward pass then goes down the layers one at a time, each one's
+// activations recomputed from its input by differentiating it on its own. these are the pieces
+
+void layer_window(int l, float* x, int nt, int pos, Config* __restrict__ p, RunState* __restrict__ s,
+                  TransformerWeights* __restrict__ w, LoraWeights* lw) {
+    // layer l of nt consecutive positions of the sequence in slot 0 from pos on, in place on x (nt, dim)
+    int slots[MAX_CHUNK];
+    int positions[MAX_CHUNK];
+    for (int c = 0; c < nt; c += MAX_CHUNK) {
+        int n = nt - c < MAX_CHUNK ? nt - c : MAX_CHUNK;
+        for (int t = 0; t < n; t++) {
+            slots[t] = 0;
+            positions[t] = pos + c + t;
+        }
+        transformer_layer(l, x + c * p->dim, slots, positions, n, p, s, w, lw);
+    }
+}
+
+float head_loss(float* x, int* tokens, int nt, Config* __restrict__ p, RunState* __restrict__ s,
+                TransformerWeights* __restrict__ w, float* losses, float temperature) {
+    // the rest of sequence_loss after the last layer, from its output x (nt, dim)
+    int dim = p->dim;
+    float total = 0.0f;
+    for (int c = 0; c < nt; c += MAX_CHUNK) {
+        int n = nt - c < MAX_CHUNK ? nt - c : MAX_CHUNK;
+        for (int t = 0; t < n; t++) {
+            rmsnorm(s->xb + t * dim, x + (c + t) * dim, w->rms_final_weight, dim);
+        }
+        matmul(s->logits, s->xb, w->wcls, dim, p->vocab_size, n);
+        for (int t = 0; t < n; t++) {
+            losses[c + t] = logits_loss(s->logits + t * p->vocab_size, tokens[c + t + 1], p->vocab_size, temperature);
+            total += losses[c + t];
+        }
+    }
+    return total;
+}
+
+// ----------------------------------------------------------------------------
+// byte-level prefix trie over the vocab, for greedy longest-match tokenization
+
+typedef struct {
+    int child;   // index of the first child node, -1 if none
+    int sibling; // index of the next node with the same parent, -1 if none
+    int id;      // vocab id of the token ending at this node, -1 if none
+    unsigned char c; // byte on the edge leading into this node
+} TrieNode;
+
+typedef struct {
+    TrieNode* nodes; // node 0 is the root (the empty string)
+    int n_nodes;
+    int root[256]; // direct lookup of the root's children, the widest fan-out by far
+    int byte_id[256]; // fallback for a byte no token matches: its <0xXX> token, else 0 (<unk>)
+} VocabTrie;
+
+int trie_child(VocabTrie* t, int node, unsigned char c) {
+    if (node == 0) { return t->root[c]; }
+    for (int n = t->nodes[node].child; n != -1; n = t->nodes[n].sibling) {
+        if (t->nodes[n].c == c) { return n; }
+    }
+    return -1;
+}
+
+void build_vocab_trie(VocabTrie* t, char** vocab, int vocab_size) {
+    // upper bound on the node count is the total length of all tokens, plus the root
+    int capacity = 1;
+    for (int i = 0; i < vocab_size; i++) { capacity += strlen(vocab[i]); }
+    t->nodes = malloc(capacity * sizeof(TrieNode));
+    if (!t->nodes) { printf("malloc failed!\n"); exit(1); }
+    t->nodes[0] = (TrieNode){ .child = -1, .sibling = -1, .id = -1, .c = 0 };
+    t->n_nodes = 1;
+    for (int c = 0; c < 256; c++) { t->root[c] = -1; }
+    for (int i = 0; i < vocab_size; i++) {
+        int node = 0;
+        for (unsigned char* str = (unsigned char*)vocab[i]; *str; str++) {
+            int next = trie_child(t, node, *str);
+            if (next == -1) {
+                next = t->n_nodes++;
+                t->nodes[next] = (TrieNode){ .child = -1, .sibling = t->nodes[node].child, .id = -1, .c = *str };
+                t->nodes[node].child = next;
+                if (node == 0) { t->root[*str] = next; }
+            }
+            node = next;
+        }
+        // on duplicate strings keep the lowest id, same as a linear scan over the vocab would
+        if (t->nodes[node].id == -1) { t->nodes[node].id = i; }
+    }
+    for (int c = 0; c < 256; c++) {
+        char name[8];
+        snprintf(name, sizeof(name), "<0x%02X>", c);
+        int node = 0;
+        for (char* str = name; *str && node != -1; str++) { node = trie_child(t, node, (unsigned char)*str); }
+        t->byte_id[c] = node != -1 && t->nodes[node].id != -1 ? t->nodes[node].id : 0;
+    }
+}
+
+void free_vocab_trie(VocabTrie* t) {
+    free(t->nodes);
+}
+
+int trie_longest_match(VocabTrie* t, char* text, long len, int* match_len) {
+    // walk down the trie along text, remembering the deepest node that ends a token. if no
+    // token is a prefix of text, match_len is 0 and the id is the fallback for its first byte
+    int best = t->byte_id[(unsigned char)text[0]];
+    *match_len = 0;
+    int node = 0;
+    for (long i = 0; i < len; i++) {
+        node = trie_child(t, node, (unsigned char)text[i]);
+        if (node == -1) { break; }
+        if (t->nodes[node].id != -1) {
+            best = t->nodes[node].id;
+            *match_len = i + 1;
+        }
+    }
+    return best;
+}
+
+int tokenize(VocabTrie* t, char* text, long len, int* tokens, int max, long* used) {
+    // greedily tokenize text with the longest vocab match at each byte, into at most max tokens.
+    // returns the token count, and if used isn't NULL the number of bytes they cover
+    int n = 0;
+    long i = 0;
+    while (i < len && n < max) {
+        int maxlen;
+        tokens[n++] = trie_longest_match(t, &text[i], len - i, &maxlen);
+        i += maxlen > 0 ? maxlen : 1; // an unmatched byte becomes its fallback token
+    }
+    if (used) { *used = i; }
+    return n;
+}
+
+// ----------------------------------------------------------------------------
+
+long time_in_ms() {
+    // monotonic, the wall clock can be stepped while we run
+    return time_in_ns() / 1000000;
+}
+
+int enzyme_const;
+int enzyme_primal_return;
+int enzyme_dup;
+float __enzyme_autodiff(void*, 
+        int,
+        int, int*,
+        int, int,
+        int, int,
+        int, Config*,
+        int, RunState*, RunState*,
+        int, TransformerWeights*, TransformerWeights*,
+        int, LoraWeights*,
+        int, float*, float*,
+        int, float);
+// any function whose name starts with __enzyme_autodiff is one to Enzyme, so each
+// differentiated function (and each choice of what is constant) gets its own declaration
+void __enzyme_autodiff_layer(void*,
+        int, int,
+        int, float*, float*,
+        int, int,
+        int, int,
+        int, Config*,
+        int, RunState*, RunState*,
+        int, TransformerWeights*, TransformerWeights*,
+        int, LoraWeights*);
+float __enzyme_autodiff_head(void*,
+        int,
+        int, float*, float*,
+        int, int*,
+        int, int,
+        int, Config*,
+        int, RunState*, RunState*,
+        int, TransformerWeights*, TransformerWeights*,
+        int, float*, float*,
+        int, float);
+// LoRA: the base weights are constant, only the adapters get a gradient
+float __enzyme_autodiff_lora(void*,
+        int,
+        int, int*,
+        int, int,
+        int, int,
+        int, Config*,
+        int, RunState*, RunState*,
+        int, TransformerWeights*,
+        int, LoraWeights*, LoraWeights*,
+        int, float*, float*,
+        int, float);
+void __enzyme_autodiff_lora_layer(void*,
+        int, int,
+        int, float*, float*,
+        int, int,
+        int, int,
+        int, Config*,
+        int, RunState*, RunState*,
+        int, TransformerWeights*,
+        int, LoraWeights*, LoraWeights*);
+float __enzyme_autodiff_lora_head(void*,
+        int,
+        int, float*, float*,
+        int, int*,
+        int, int,
+        int, Config*,
+        int, RunState*, RunState*,
+        int, TransformerWeights*,
+        int, float*, float*,
+        int, float);
+
+void checkpointed_step(int* tokens, int nt, int pos, Config* p, RunState* s, RunState* ds,
+                       TransformerWeights* w, TransformerWeights* dw, LoraWeights* lw, LoraWeights* dlw,
+                       float* x, float* dx, float* losses, float* dlosses, int first_layer, float temperature) {
+    // the gradient of sequence_loss, added into dw like its own __enzyme_autodiff call would, but
+    // through the layer inputs in x ((n_layers + 1) * nt * dim, the last slot the final output)
+    // and the adjoint dx (nt, dim). layers below first_layer, and the embeddings unless it is 0,
+    // are frozen, so the backward pass stops there. with dw NULL the base weights are constant
+    // and the gradient is that of the adapters lw, into dlw
+    int dim = p->dim;
+    size_t rows = (size_t)nt * dim;
+    for (int t = 0; t < nt; t++) {
+        memcpy(x + t * dim, w->token_embedding_table + (size_t)tokens[t] * dim, dim * sizeof(float));
+    }
+    for (int l = 0; l < p->n_layers; l++) {
+        memcpy(x + (l + 1) * rows, x + l * rows, rows * sizeof(float));
+        layer_window(l, x + (l + 1) * rows, nt, pos, p, s, w, lw);
+    }
+    memset(dx, 0, rows * sizeof(float));
+    if (dw) {
+        __enzyme_autodiff_head((void*)head_loss,
+                               enzyme_primal_return,
+                               enzyme_dup, x + p->n_layers * rows, dx,
+                               enzyme_const, tokens,
+                               enzyme_const, nt,
+                               enzyme_const, p,
+                               enzyme_dup, s, ds,
+                               enzyme_dup, w, dw,
+                               enzyme_dup, losses, dlosses,
+                               enzyme_const, temperature);
+    } else {
+        __enzyme_autodiff_lora_head((void*)head_loss,
+                                    enzyme_primal_return,
+                                    enzyme_dup, x + p->n_layers * rows, dx,
+                                    enzyme_const, tokens,
+                                    enzyme_const, nt,
+                                    enzyme_const, p,
+                                    enzyme_dup, s, ds,
+                                    enzyme_const, w,
+                                    enzyme_dup, losses, dlosses,
+                                    enzyme_const, temperature);
+    }
+    zero_activations(ds, p);
+    for (int l = p->n_layers - 1; l >= first_layer; l--) {
+        // the output slot of layer l is free by now, it becomes the recomputed input, in place.
+        // dx goes in as the adjoint of the layer's output and comes out as that of its input
+        memcpy(x + (l + 1) * rows, x + l * rows, rows * sizeof(float));
+        if (dw) {
+            __enzyme_autodiff_layer((void*)layer_window,
+                                    enzyme_const, l,
+                                    enzyme_dup, x + (l + 1) * rows, dx,
+                                    enzyme_const, nt,
+                                    enzyme_const, pos,
+                                    enzyme_const, p,
+                                    enzyme_dup, s, ds,
+                                    enzyme_dup, w, dw,
+                                    enzyme_const, lw);
+        } else {
+            __enzyme_autodiff_lora_layer((void*)layer_window,
+                                         enzyme_const, l,
+                                         enzyme_dup, x + (l + 1) * rows, dx,
+                                         enzyme_const, nt,
+                                         enzyme_const, pos,
+                                         enzyme_const, p,
+                                         enzyme_dup, s, ds,
+                                         enzyme_const, w,
+                                         enzyme_dup, lw, dlw);
+        }
+        zero_activations(ds, p);
+    }
+    if (first_layer == 0 && dw) {
+        // the embedding lookup, the one step that is not differentiated by Enzyme
+        for (int t = 0; t < nt; t++) {
+            float* drow = dw->token_embedding_table + (size_t)tokens[t] * dim;
+            for (int i = 0; i < dim; i++) { drow[i] += dx[t * dim + i]; }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// fine-tuning: gradient buffers for the trainable tensors
+
+// rows of a tensor (the token embeddings) that only get gradient when they are
+// looked up, so that a step can skip all the rows nobody touched
+typedef struct {
+    int n_rows; // number of tracked rows
+    int row_size; // floats per row
+    unsigned char* dirty; // (n_rows,) 1 if the row received gradient since the last step
+    int* rows; // (n_rows,) the dirty rows, in the order they were touched
+    int n_dirty;
+} RowTracker;
+
+void malloc_row_tracker(RowTracker* r, int n_rows, int row_size) {
+    r->n_rows = n_rows;
+    r->row_size = row_size;
+    r->n_dirty = 0;
+    r->dirty = calloc(n_rows, sizeof(unsigned char));
+    r->rows = calloc(n_rows, sizeof(int));
+    if (!r->dirty || !r->rows) { printf("malloc failed!\n"); exit(1); }
+}
+
+void free_row_tracker(RowTracker* r) {
+    free(r->dirty);
+    free(r->rows);
+}
+
+void row_mark(RowTracker* r, int row) {
+    if (!r->dirty[row]) {
+        r->dirty[row] = 1;
+        r->rows[r->n_dirty++] = row;
+    }
+}
+
+typedef struct {
+    float* w; // the trainable weights
+    float* dw; // their gradient
+    size_t n; // number of floats
+    size_t state_offset; // where this tensor's slice starts in the optimizer state
+    RowTracker* rows; // if not NULL, only the dirty rows have gradient
+} Param;
+
+#define MAX_PARAMS 16
+
+typedef struct {
+    float* arena; // one lazily paged anonymous mapping backing all the gradient buffers
+    size_t arena_size; // in bytes
+    Param params[MAX_PARAMS]; // the trainable tensors, as the optimizer sees them
+    int n_params;
+} Gradients;
+
+void malloc_gradients(Gradients* g, TransformerWeights* dw, TransformerWeights* w, Config* p,
+                      int shared_weights, int freeze_embeddings, int freeze_layers) {
+    // every tensor the forward pass reads needs a shadow pointer for Enzyme to write into,
+    // but only trainable tensors get their own buffer. fully frozen ones (and freq_cis,
+    // which is never trained) all alias one shared sink that is written and never read.
+    // with the first freeze_layers layers frozen, the per-layer tensors keep a buffer but
+    // their frozen slices are left out of the optimizer and are never zeroed either
+    int head_size = p->dim / p->n_heads;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    if (freeze_layers > p->n_layers) { freeze_layers = p->n_layers; }
+    struct { float* w; float* __restrict__* dw; size_t layer_size; int n_layers; int frozen; } t[] = {
+        { w->token_embedding_table, &dw->token_embedding_table, (size_t)p->vocab_size * p->dim, 1, freeze_embeddings },
+        { w->rms_att_weight, &dw->rms_att_weight, p->dim, p->n_layers, freeze_layers },
+        { w->wq, &dw->wq, (size_t)p->dim * p->dim, p->n_layers, freeze_layers },
+        { w->wk, &dw->wk, (size_t)p->dim * kv_dim, p->n_layers, freeze_layers },
+        { w->wv, &dw->wv, (size_t)p->dim * kv_dim, p->n_layers, freeze_layers },
+        { w->wo, &dw->wo, (size_t)p->dim * p->dim, p->n_layers, freeze_layers },
+        { w->rms_ffn_weight, &dw->rms_ffn_weight, p->dim, p->n_layers, freeze_layers },
+        { w->w1, &dw->w1, (size_t)p->dim * p->hidden_dim, p->n_layers, freeze_layers },
+        { w->w2, &dw->w2, (size_t)p->hidden_dim * p->dim, p->n_layers, freeze_layers },
+        { w->w3, &dw->w3, (size_t)p->dim * p->hidden_dim, p->n_layers, freeze_layers },
+        { w->rms_final_weight, &dw->rms_final_weight, p->dim, 1, 0 },
+        { w->freq_cis_real, &dw->freq_cis_real, (size_t)p->seq_len * head_size / 2, 1, 1 },
+        { w->freq_cis_imag, &dw->freq_cis_imag, (size_t)p->seq_len * head_size / 2, 1, 1 },
+        { w->wcls, &dw->wcls, (size_t)p->vocab_size * p->dim, 1, 0 },
+    };
+    int n_tensors = sizeof(t) / sizeof(t[0]) - (shared_weights ? 1 : 0);
+
+    // lay the buffers out in one mapping, each 64-byte aligned, the sink first
+    size_t sink = 0, total = 0;
+    for (int i = 0; i < n_tensors; i++) {
+        size_t n = t[i].layer_size * t[i].n_layers;
+        if (t[i].frozen >= t[i].n_layers) { if (n > sink) { sink = n; } }
+        else { total += (n + 15) & ~(size_t)15; }
+    }
+    sink = (sink + 15) & ~(size_t)15;
+    // anonymous pages read as zero and are only backed once written, so there is no memset
+    // and tensors Enzyme never writes into never become resident
+    g->arena_size = (sink + total) * sizeof(float);
+    g->arena = mmap(NULL, g->arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (g->arena == MAP_FAILED) { printf("mmap failed!\n"); exit(1); }
+
+    g->n_params = 0;
+    float* ptr = g->arena + sink;
+    for (int i = 0; i < n_tensors; i++) {
+        size_t n = t[i].layer_size * t[i].n_layers;
+        if (t[i].frozen >= t[i].n_layers) { *t[i].dw = g->arena; continue; }
+        *t[i].dw = ptr;
+        size_t skip = t[i].layer_size * t[i].frozen;
+        g->params[g->n_params++] = (Param){ .w = t[i].w + skip, .dw = ptr + skip, .n = n - skip, .rows = NULL };
+        ptr += (n + 15) & ~(size_t)15;
+    }
+    if (shared_weights) { dw->wcls = dw->token_embedding_table; }
+}
+
+void free_gradients(Gradients* g) {
+    munmap(g->arena, g->arena_size);
+}
+
+// ----------------------------------------------------------------------------
+// LoRA adapters: fine-tuning low-rank updates of the matmul weights instead of the weights
+
+// adapter files start with this magic number, "lora" in ASCII
+#define LORA_MAGIC 0x6c6f7261
+// the attention matmuls, and w1, w2, w3 with ffn
+#define MAX_LORA_TARGETS 7
+
+// adapter files: this header, then A and B of every adapted matmul in lora_targets() order, fp32
+typedef struct {
+    uint32_t magic;
+    int version; // 1
+    Config config; // of the base model, adapters only fit the model they were trained on
+    int rank;
+    float alpha;
+    int ffn;
+} LoraHeader;
+
+typedef struct {
+    float** a; // (layer, rank, n)
+    float** b; // (layer, d, rank)
+    int n; // the adapted matmul W is (d, n)
+    int d;
+} LoraTarget;
+
+int lora_targets(LoraWeights* lw, Config* p, LoraTarget* t) {
+    // the adapted matmuls, in a fixed order. returns how many
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    t[0] = (LoraTarget){ &lw->wq_a, &lw->wq_b, p->dim, p->dim };
+    t[1] = (LoraTarget){ &lw->wk_a, &lw->wk_b, p->dim, kv_dim };
+    t[2] = (LoraTarget){ &lw->wv_a, &lw->wv_b, p->dim, kv_dim };
+    t[3] = (LoraTarget){ &lw->wo_a, &lw->wo_b, p->dim, p->dim };
+    if (!lw->ffn) { return 4; }
+    t[4] = (LoraTarget){ &lw->w1_a, &lw->w1_b, p->dim, p->hidden_dim };
+    t[5] = (LoraTarget){ &lw->w2_a, &lw->w2_b, p->hidden_dim, p->dim };
+    t[6] = (LoraTarget){ &lw->w3_a, &lw->w3_b, p->dim, p->hidden_dim };
+    return 7;
+}
+
+void malloc_lora(LoraWeights* lw, Config* p, int rank, float alpha, int ffn, uint64_t* rng) {
+    // fresh adapters: A uniform in +-1/sqrt(n) like a torch Linear, B zero, so that training
+    // starts from exactly the base model. rank 0 leaves every pointer NULL
+    memset(lw, 0, sizeof(*lw));
+    lw->rank = rank;
+    lw->alpha = alpha;
+    lw->scale = rank > 0 ? alpha / rank : 0.0f;
+    lw->ffn = ffn;
+    if (rank == 0) { return; }
+    LoraTarget t[MAX_LORA_TARGETS];
+    int n_targets = lora_targets(lw, p, t);
+    for (int k = 0; k < n_targets; k++) {
+        size_t n_a = (size_t)p->n_layers * rank * t[k].n;
+        *t[k].a = malloc(n_a * sizeof(float));
+        *t[k].b = calloc((size_t)p->n_layers * t[k].d * rank, sizeof(float));
+        if (!*t[k].a || !*t[k].b) { printf("malloc failed!\n"); exit(1); }
+        float bound = 1.0f / sqrtf(t[k].n);
+        for (size_t i = 0; i < n_a; i++) { (*t[k].a)[i] = (2.0f * random_f32(rng) - 1.0f) * bound; }
+    }
+}
+
+void free_lora(LoraWeights* lw, Config* p) {
+    // leaves lw without adapters, rank 0
+    if (lw->rank == 0) { return; }
+    LoraTarget t[MAX_LORA_TARGETS];
+    int n_targets = lora_targets(lw, p, t);
+    for (int k = 0; k < n_targets; k++) {
+        free(*t[k].a);
+        free(*t[k].b);
+    }
+    malloc_lora(lw, p, 0, 0.0f, 0, NULL);
+}
+
+int read_lora(char* path, LoraWeights* lw, Config* p) {
+    // adapters from a file written by write_lora, for the model with Config p. returns nonzero on failure
+    FILE* file = fopen(path, "rb");
+    if (!file) { printf("Unable to open the adapter file %s!\n", path); return 1; }
+    LoraHeader h;
+    if (fread(&h, sizeof(h), 1, file) != 1 || h.magic != LORA_MAGIC || h.version != 1) {
+        printf("%s is not an adapter file\n", path);
+        fclose(file);
+        return 1;
+    }
+    h.config.seq_len = p->seq_len; // which --ctx it ran with doesn't matter
+    if (memcmp(&h.config, p, sizeof(Config)) != 0 || h.rank < 1 || h.rank > MAX_LORA_RANK) {
+        printf("The adapters in %s don't fit this model\n", path);
+        fclose(file);
+        return 1;
+    }
+    uint64_t unused = 1;
+    malloc_lora(lw, p, h.rank, h.alpha, h.ffn, &unused);
+    LoraTarget t[MAX_LORA_TARGETS];
+    int n_targets = lora_targets(lw, p, t);
+    for (int k = 0; k < n_targets; k++) {
+        size_t n_a = (size_t)p->n_layers * h.rank * t[k].n;
+        size_t n_b = (size_t)p->n_layers * t[k].d * h.rank;
+        if (fread(*t[k].a, sizeof(float), n_a, file) != n_a || fread(*t[k].b, sizeof(float), n_b, file) != n_b) {
+            printf("Failed to read the adapters in %s\n", path);
+            fclose(file);
+            return 1;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+int write_lora(char* path, LoraWeights* lw, Config* p) {
+    // returns nonzero on failure
+    FILE* file = fopen(path, "wb");
+    if (!file) { printf("Unable to open %s for writing!\n", path); return 1; }
+    LoraHeader h = { .magic = LORA_MAGIC, .version = 1, .config = *p, .rank = lw->rank, .alpha = lw->alpha, .ffn = lw->ffn };
+    int ok = fwrite(&h, sizeof(h), 1, file) == 1;
+    LoraTarget t[MAX_LORA_TARGETS];
+    int n_targets = lora_targets(lw, p, t);
+    for (int k = 0; k < n_targets && ok; k++) {
+        size_t n_a = (size_t)p->n_layers * lw->rank * t[k].n;
+        size_t n_b = (size_t)p->n_layers * t[k].d * lw->rank;
+        ok = fwrite(*t[k].a, sizeof(float), n_a, file) == n_a && fwrite(*t[k].b, sizeof(float), n_b, file) == n_b;
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok) { printf("Failed to write the adapters to %s\n", path); }
+    return !ok;
+}
+
+void merge_lora(LoraWeights* lw, Config* p, TransformerWeights* w, QuantizedWeights* qw) {
+    // folds the adapters into the weights, W += scale * B A, so inference runs exactly as fast as
+    // without them. int8 or 16-bit weights (qw if not NULL) are dequantized a row at a time and
+    // requantized.
+    // the weights must be writable
+    LoraTarget t[MAX_LORA_TARGETS];
+    int n_targets = lora_targets(lw, p, t);
+    float* base[MAX_LORA_TARGETS] = { NULL };
+    QuantizedTensor* qbase[MAX_LORA_TARGETS] = { NULL };
+    if (qw) {
+        QuantizedTensor* q[] = { &qw->wq, &qw->wk, &qw->wv, &qw->wo, &qw->w1, &qw->w2, &qw->w3 };
+        memcpy(qbase, q, sizeof(q));
+    } else {
+        float* f[] = { w->wq, w->wk, w->wv, w->wo, w->w1, w->w2, w->w3 };
+        memcpy(base, f, sizeof(f));
+    }
+    int r = lw->rank;
+    int max_n = p->dim > p->hidden_dim ? p->dim : p->hidden_dim;
+    for (int k = 0; k < n_targets; k++) {
+        int n = t[k].n, d = t[k].d;
+        #pragma omp parallel for
+        for (size_t row = 0; row < (size_t)p->n_layers * d; row++) {
+            float buf[max_n];
+            size_t l = row / d;
+            size_t off = row * n;
+            float* a = *t[k].a + l * r * n;
+            float* b = *t[k].b + row * r;
+            float* wr = qw ? buf : base[k] + off;
+            if (qw && qw->dtype != DTYPE_Q8_0) {
+                dequantize_half(wr, qbase[k]->h + off, n, qw->dtype == DTYPE_BF16);
+            } else if (qw) {
+                dequantize(wr, qbase[k]->q + off, qbase[k]->s + off / qw->group_size, n, qw->group_size);
+            }
+            for (int j = 0; j < r; j++) {
+                float bj = lw->scale * b[j];
+                for (int i = 0; i < n; i++) { wr[i] += bj * a[(size_t)j * n + i]; }
+            }
+            if (qw && qw->dtype != DTYPE_Q8_0) {
+                quantize_half(qbase[k]->h + off, wr, n, qw->dtype == DTYPE_BF16);
+            } else if (qw) {
+                quantize(qbase[k]->q + off, qbase[k]->s + off / qw->group_size, wr, n, qw->group_size);
+            }
+        }
+    }
+}
+
+void malloc_lora_gradients(Gradients* g, LoraWeights* dlw, LoraWeights* lw, Config* p) {
+    // the shadow adapters for Enzyme, one buffer per tensor in a lazily paged mapping like
+    // malloc_gradients(). every adapter tensor is trainable, and nothing else is
+    *dlw = *lw;
+    LoraTarget t[MAX_LORA_TARGETS], dt[MAX_LORA_TARGETS];
+    int n_targets = lora_targets(lw, p, t);
+    lora_targets(dlw, p, dt);
+    size_t total = 0;
+    for (int k = 0; k < n_targets; k++) {
+        total += (((size_t)p->n_layers * lw->rank * t[k].n + 15) & ~(size_t)15)
+               + (((size_t)p->n_layers * t[k].d * lw->rank + 15) & ~(size_t)15);
+    }
+    g->arena_size = total * sizeof(float);
+    g->arena = mmap(NULL, g->arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (g->arena == MAP_FAILED) { printf("mmap failed!\n"); exit(1); }
+    g->n_params = 0;
+    float* ptr = g->arena;
+    for (int k = 0; k < n_targets; k++) {
+        size_t n_a = (size_t)p->n_layers * lw->rank * t[k].n;
+        size_t n_b = (size_t)p->n_layers * t[k].d * lw->rank;
+        *dt[k].a = ptr;
+        g->params[g->n_params++] = (Param){ .w = *t[k].a, .dw = ptr, .n = n_a, .rows = NULL };
+        ptr += (n_a + 15) & ~(size_t)15;
+        *dt[k].b = ptr;
+        g->params[g->n_params++] = (Param){ .w = *t[k].b, .dw = ptr, .n = n_b, .rows = NULL };
+        ptr += (n_b + 15) & ~(size_t)15;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// fine-tuning: optimizers applying the accumulated gradient to the weights
+
+typedef enum { OPT_SGD, OPT_ADAMW } OptimizerType;
+
+typedef struct {
+    OptimizerType type;
+    float lr; // learning rate
+    float momentum; // SGD momentum, 0 disables the momentum buffer
+    float beta1, beta2, eps; // AdamW moment decay rates and denominator epsilon
+    float weight_decay; // decoupled weight decay
+    float grad_clip; // max global gradient norm, 0 disables clipping
+    int t; // number of steps taken so far, for the AdamW bias correction
+    size_t n; // total number of trainable parameters
+    float* m; // SGD momentum buffer or AdamW first moment (n,)
+    float* v; // AdamW second moment (n,)
+} Optimizer;
+
+void malloc_optimizer(Optimizer* o, Param* params, int n_params) {
+    // the state of all trainable tensors lives in one buffer, each at its own offset
+    o->n = 0;
+    for (int i = 0; i < n_params; i++) {
+        params[i].state_offset = o->n;
+        o->n += params[i].n;
+    }
+    o->t = 0;
+    o->m = NULL;
+    o->v = NULL;
+    if (o->type == OPT_ADAMW || o->momentum != 0.0f) {
+        o->m = calloc(o->n, sizeof(float));
+        if (!o->m) { printf("malloc failed!\n"); exit(1); }
+    }
+    if (o->type == OPT_ADAMW) {
+        o->v = calloc(o->n, sizeof(float));
+        if (!o->v) { printf("malloc failed!\n"); exit(1); }
+    }
+}
+
+void free_optimizer(Optimizer* o) {
+    free(o->m);
+    free(o->v);
+}
+
+double grad_sumsq(float* __restrict__ dw, size_t n) {
+    double ss = 0.0;
+    #pragma omp parallel for simd reduction(+:ss) if(n > 4096)
+    for (size_t i = 0; i < n; i++) {
+        ss += dw[i] * dw[i];
+    }
+    return ss;
+}
+
+void optimizer_update(Optimizer* o, float* __restrict__ w, float* __restrict__ dw, size_t offset, size_t n, float scale) {
+    // a single fused pass over n floats that steps w and the optimizer state
+    // (starting at offset) and zeroes dw
+    float lr = o->lr;
+    float decay = 1.0f - o->lr * o->weight_decay;
+    if (o->type == OPT_ADAMW) {
+        float* __restrict__ m = o->m + offset;
+        float* __restrict__ v = o->v + offset;
+        float b1 = o->beta1, b2 = o->beta2, eps = o->eps;
+        float bc1 = 1.0f / (1.0f - powf(b1, o->t));
+        float bc2 = 1.0f / (1.0f - powf(b2, o->t));
+        #pragma omp parallel for simd if(n > 4096)
+        for (size_t i = 0; i < n; i++) {
+            float g = dw[i] * scale;
+            m[i] = b1 * m[i] + (1.0f - b1) * g;
+            v[i] = b2 * v[i] + (1.0f - b2) * g * g;
+            w[i] = w[i] * decay - lr * (m[i] * bc1) / (sqrtf(v[i] * bc2) + eps);
+            dw[i] = 0.0f;
+        }
+    } else if (o->m) {
+        float* __restrict__ m = o->m + offset;
+        float mu = o->momentum;
+        #pragma omp parallel for simd if(n > 4096)
+        for (size_t i = 0; i < n; i++) {
+            m[i] = mu * m[i] + dw[i] * scale;
+            w[i] = w[i] * decay - lr * m[i];
+            dw[i] = 0.0f;
+        }
+    } else {
+        #pragma omp parallel for simd if(n > 4096)
+        for (size_t i = 0; i < n; i++) {
+            w[i] = w[i] * decay - lr * dw[i] * scale;
+            dw[i] = 0.0f;
+        }
+    }
+}
+
+double grad_norm_sq(Param* params, int n_params) {
+    // a read-only reduction for the squared global gradient norm. for row-tracked
+    // params it only visits the dirty rows
+    double ss = 0.0;
+    for (int i = 0; i < n_params; i++) {
+        Param* p = &params[i];
+        RowTracker* r = p->rows;
+        if (!r) { ss += grad_sumsq(p->dw, p->n); continue; }
+        for (int k = 0; k < r->n_dirty; k++) {
+            ss += grad_sumsq(p->dw + (size_t)r->rows[k] * r->row_size, r->row_size);
+        }
+    }
+    return ss;
+}
+
+float optimizer_step(Optimizer* o, Param* params, int n_params, int n_accum, double ss) {
+    // Enzyme accumulated the gradient of n_accum tokens into the params, ss is its squared
+    // norm from grad_norm_sq. the norm also catches NaN/inf blow-ups. then a single fused
+    // update pass, which for row-tracked params only visits the dirty rows. note this makes
+    // the optimizer state of untouched rows lazy: their momentum and weight decay are not
+    // applied until they are next used
+    float norm = sqrt(ss) / n_accum;
+    if (!isfinite(norm)) {
+        printf("gradient norm is %f, aborting\n", norm);
+        exit(1);
+    }
+    float scale = 1.0f / n_accum;
+    if (o->grad_clip > 0.0f && norm > o->grad_clip) { scale *= o->grad_clip / norm; }
+    o->t++;
+
+    for (int i = 0; i < n_params; i++) {
+        Param* p = &params[i];
+        RowTracker* r = p->rows;
+        if (!r) { optimizer_update(o, p->w, p->dw, p->state_offset, p->n, scale); continue; }
+        for (int k = 0; k < r->n_dirty; k++) {
+            size_t off = (size_t)r->rows[k] * r->row_size;
+            optimizer_update(o, p->w + off, p->dw + off, p->state_offset + off, r->row_size, scale);
+            r->dirty[r->rows[k]] = 0;
+        }
+        r->n_dirty = 0;
+    }
+    return norm;
+}
+
+// ----------------------------------------------------------------------------
+// fine-tuning: data parallel over forked processes, one shard of the training data each.
+// before every optimizer step the gradients are all-reduced through shared memory, so every
+// process applies the exact same update to its own copy-on-write copy of the weights
+
+// max number of processes
+#define MAX_RANKS 64
+// floats of gradient reduced per round, the size of each staging slot
+#define REDUCE_CHUNK (1 << 20)
+
+typedef struct {
+    pthread_barrier_t barrier; // process-shared
+    long n_tokens[MAX_RANKS]; // per rank, the tokens its gradient is summed over
+    int more[MAX_RANKS]; // per rank, 1 if it has training data left
+    double sumsq[MAX_RANKS]; // per rank, the squared norm of its share of the reduced gradient
+} ReduceHeader;
+
+typedef struct {
+    int n_ranks;
+    int rank; // 0 is the original process, which continues after fine-tuning
+    int bf16; // stage gradients as bf16, halving what every rank writes and reads
+    char* shared; // one shared mapping: the header, n_ranks staging slots, then the result chunk
+    size_t shared_size;
+    ReduceHeader* header;
+    void* stage; // (n_ranks, REDUCE_CHUNK) fp32 or bf16
+    float* result; // (REDUCE_CHUNK,)
+} DataParallel;
+
+void init_data_parallel(DataParallel* dp, int n_ranks, int bf16) {
+    // maps the shared memory, the processes are forked afterwards
+    dp->n_ranks = n_ranks;
+    dp->rank = 0;
+    dp->bf16 = bf16;
+    size_t value_size = bf16 ? sizeof(uint16_t) : sizeof(float);
+    size_t header_size = (sizeof(ReduceHeader) + 63) & ~(size_t)63;
+    dp->shared_size = header_size + (size_t)n_ranks * REDUCE_CHUNK * value_size + REDUCE_CHUNK * sizeof(float);
+    dp->shared = mmap(NULL, dp->shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (dp->shared == MAP_FAILED) { printf("mmap failed!\n"); exit(1); }
+    dp->header = (ReduceHeader*)dp->shared;
+    dp->stage = dp->shared + header_size;
+    dp->result = (float*)(dp->shared + header_size + (size_t)n_ranks * REDUCE_CHUNK * value_size);
+    pthread_barrierattr_t attr;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&dp->header->barrier, &attr, n_ranks);
+    pthread_barrierattr_destroy(&attr);
+}
+
+void free_data_parallel(DataParallel* dp) {
+    // by the last rank out, after all the others are done with it
+    pthread_barrier_destroy(&dp->header->barrier);
+    munmap(dp->shared, dp->shared_size);
+}
+
+double allreduce_gradients(DataParallel* dp, Param* params, int n_params, long* n_tokens, int* more) {
+    // sums the gradients of all ranks into every rank's params, a chunk at a time: each rank
+    // stages its chunk, then reduces its own 1/n_ranks of the chunk over all the slots, and
+    // once all the shares are in, copies the whole result back. the sums are always taken
+    // in rank order, so every rank gets the same bits. n_tokens and more are summed and or'ed
+    // over the ranks too. returns the squared norm of the sum, the same on every rank
+    ReduceHeader* h = dp->header;
+    int n_ranks = dp->n_ranks, rank = dp->rank;
+    uint16_t* stage16 = dp->stage;
+    float* stage32 = dp->stage;
+    h->n_tokens[rank] = *n_tokens;
+    h->more[rank] = *more;
+    double ss = 0.0;
+    for (int k = 0; k < n_params; k++) {
+        Param* p = &params[k];
+        for (size_t off = 0; off < p->n; off += REDUCE_CHUNK) {
+            size_t n = p->n - off < REDUCE_CHUNK ? p->n - off : REDUCE_CHUNK;
+            float* dw = p->dw + off;
+            if (dp->bf16) {
+                uint16_t* slot = stage16 + (size_t)rank * REDUCE_CHUNK;
+                for (size_t i = 0; i < n; i++) { slot[i] = float_to_bf16(dw[i]); }
+            } else {
+                memcpy(stage32 + (size_t)rank * REDUCE_CHUNK, dw, n * sizeof(float));
+            }
+            pthread_barrier_wait(&h->barrier);
+            size_t start = n * rank / n_ranks, end = n * (rank + 1) / n_ranks;
+            for (size_t i = start; i < end; i++) {
+                float sum = 0.0f;
+                for (int r = 0; r < n_ranks; r++) {
+                    sum += dp->bf16 ? bf16_to_float(stage16[(size_t)r * REDUCE_CHUNK + i]) : stage32[(size_t)r * REDUCE_CHUNK + i];
+                }
+                dp->result[i] = sum;
+                ss += (double)sum * sum;
+            }
+            // the next chunk's staging doesn't touch the result, and its reduce waits for everyone
+            pthread_barrier_wait(&h->barrier);
+            memcpy(dw, dp->result, n * sizeof(float));
+        }
+    }
+    h->sumsq[rank] = ss;
+    pthread_barrier_wait(&h->barrier);
+    ss = 0.0;
+    *n_tokens = 0;
+    *more = 0;
+    for (int r = 0; r < n_ranks; r++) {
+        ss += h->sumsq[r];
+        *n_tokens += h->n_tokens[r];
+        *more |= h->more[r];
+    }
+    // until everyone has read the header, before the next call overwrites it
+    pthread_barrier_wait(&h->barrier);
+    return ss;
+}
+
+// ----------------------------------------------------------------------------
+// training data stream: the training text (or pretokenized shards) is mapped, not read in,
+// and a background thread tokenizes ahead into a bounded ring while the gradients are computed
+
+// tokens in the ring, a power of 2
+#define STREAM_RING (1 << 16)
+// tokens the thread produces between locks
+#define STREAM_BATCH 4096
+// bytes the thread lets pile up behind it before it drops them from the mapping
+#define STREAM_DROP (16L << 20)
+
+typedef struct {
+    // the source: one text file, or uint16 token shards as written by tinystories.py pretokenize
+    int pretokenized;
+    int n_files;
+    char** data; // (n_files,) read-only mappings, NULL if empty
+    long* size;  // (n_files,) in bytes
+    long length; // of the whole source, in bytes of text or in tokens
+    long start, end; // the part of it this stream produces, same units
+    VocabTrie* trie; // for text
+    int vocab_size; // for checking the pretokenized ids fit the model
+    // the ring, filled by the thread and drained by the training loop
+    int* ring;
+    long head; // tokens produced so far
+    long tail; // tokens consumed so far
+    int done;  // the thread has produced its last token
+    int stop;  // asks the thread to finish early
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // broadcast on every change of head, tail, done or stop
+    pthread_t thread;
+    int started;
+} TokenStream;
+
+int has_suffix(char* s, char* suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+int open_token_stream(TokenStream* ts, char* path, VocabTrie* trie, int vocab_size) {
+    // maps path: a directory of .bin shards, a single .bin shard, or anything else as text
+    memset(ts, 0, sizeof(*ts));
+    ts->trie = trie;
+    ts->vocab_size = vocab_size;
+    glob_t g = { 0 };
+    char** paths = &path;
+    int n_files = 1;
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        char pattern[4096];
+        snprintf(pattern, sizeof(pattern), "%s/*.bin", path);
+        if (glob(pattern, 0, NULL, &g) != 0) { printf("No .bin shards in %s\n", path); return 1; }
+        paths = g.gl_pathv; // sorted, the same order tinystories.py reads them in
+        n_files = g.gl_pathc;
+        ts->pretokenized = 1;
+    } else {
+        ts->pretokenized = has_suffix(path, ".bin");
+    }
+    ts->n_files = n_files;
+    ts->data = calloc(n_files, sizeof(char*));
+    ts->size = calloc(n_files, sizeof(long));
+    ts->ring = malloc(STREAM_RING * sizeof(int));
+    if (!ts->data || !ts->size || !ts->ring) { printf("malloc failed!\n"); exit(1); }
+    for (int f = 0; f < n_files; f++) {
+        int fd = open(paths[f], O_RDONLY);
+        if (fd == -1 || fstat(fd, &st) != 0) { printf("Unable to open %s\n", paths[f]); return 1; }
+        ts->size[f] = st.st_size;
+        if (st.st_size > 0) {
+            ts->data[f] = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ts->data[f] == MAP_FAILED) { printf("mmap failed!\n"); exit(1); }
+            madvise(ts->data[f], st.st_size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+        ts->length += ts->pretokenized ? st.st_size / (long)sizeof(uint16_t) : st.st_size;
+    }
+    globfree(&g);
+    pthread_mutex_init(&ts->mutex, NULL);
+    pthread_cond_init(&ts->cond, NULL);
+    return 0;
+}
+
+int stream_push(TokenStream* ts, int* tokens, int n) {
+    // blocks while the ring is full, returns 0 if the stream was stopped
+    pthread_mutex_lock(&ts->mutex);
+    for (int k = 0; k < n && !ts->stop; ) {
+        while (ts->head - ts->tail == STREAM_RING && !ts->stop) { pthread_cond_wait(&ts->cond, &ts->mutex); }
+        while (k < n && ts->head - ts->tail < STREAM_RING) { ts->ring[ts->head++ & (STREAM_RING - 1)] = tokens[k++]; }
+        pthread_cond_broadcast(&ts->cond);
+    }
+    int stopped = ts->stop;
+    pthread_mutex_unlock(&ts->mutex);
+    return !stopped;
+}
 
+void stream_drop(char* data, long* dropped, long upto) {
+    // the pages behind the thread are never read again, so they don't need to stay resident
+    long page = sysconf(_SC_PAGESIZE);
+    upto = upto / page * page;
+    if (upto - *dropped < STREAM_DROP) { return; }
+    madvise(data + *dropped, upto - *dropped, MADV_DONTNEED);
+    *dropped = upto;
+}
 
-    double alpha = 1.0;
+void* stream_worker(void* arg) {
+    TokenStream* ts = arg;
+    int batch[STREAM_BATCH];
+    int running = 1;
+    long base = 0; // of the current file, in the source's units
+    for (int f = 0; f < ts->n_files && running; f++) {
+        long n = ts->pretokenized ? ts->size[f] / (long)sizeof(uint16_t) : ts->size[f];
+        long lo = ts->start > base ? ts->start - base : 0;
+        long hi = ts->end - base < n ? ts->end - base : n;
+        long dropped = 0;
+        for (long i = lo; i < hi && running; ) {
+            int nb = 0;
+            if (ts->pretokenized) {
+                uint16_t* tokens = (uint16_t*)ts->data[f];
+                while (nb < STREAM_BATCH && i < hi) { batch[nb++] = tokens[i++]; }
+                for (int k = 0; k < nb; k++) {
+                    if (batch[k] >= ts->vocab_size) { printf("token %d in shard %d is not in the vocab\n", batch[k], f); exit(1); }
+                }
+                stream_drop(ts->data[f], &dropped, i * (long)sizeof(uint16_t));
+            } else {
+                // greedily match with vocab
+                long used;
+                nb = tokenize(ts->trie, &ts->data[f][i], hi - i, batch, STREAM_BATCH, &used);
+                i += used;
+                stream_drop(ts->data[f], &dropped, i);
+            }
+            running = stream_push(ts, batch, nb);
+        }
+        base += n;
+    }
+    pthread_mutex_lock(&ts->mutex);
+    ts->done = 1;
+    pthread_cond_broadcast(&ts->cond);
+    pthread_mutex_unlock(&ts->mutex);
+    return NULL;
+}
 
-    if(training_data){
+void start_token_stream(TokenStream* ts, long start, long end) {
+    // produces the part [start, end) of the source. after any fork, threads don't survive one
+    ts->start = start;
+    ts->end = end;
+    if (pthread_create(&ts->thread, NULL, stream_worker, ts) != 0) { printf("pthread_create failed!\n"); exit(1); }
+    ts->started = 1;
+}
 
-        // read the train.txt file
-        FILE *train_file = fopen(training_data, "r");
-        if (!train_file) {
-            printf("Unable to open train.txt\n");
-            return 1;
+int stream_read(TokenStream* ts, int* tokens, int n) {
+    // blocks until n tokens are read, returns fewer only at the end of the stream
+    pthread_mutex_lock(&ts->mutex);
+    int k = 0;
+    while (k < n) {
+        while (ts->head == ts->tail && !ts->done) { pthread_cond_wait(&ts->cond, &ts->mutex); }
+        if (ts->head == ts->tail) { break; }
+        while (k < n && ts->tail < ts->head) { tokens[k++] = ts->ring[ts->tail++ & (STREAM_RING - 1)]; }
+        pthread_cond_broadcast(&ts->cond);
+    }
+    pthread_mutex_unlock(&ts->mutex);
+    return k;
+}
+
+int stream_more(TokenStream* ts) {
+    // 1 if stream_read has at least one more token to give
+    pthread_mutex_lock(&ts->mutex);
+    while (ts->head == ts->tail && !ts->done) { pthread_cond_wait(&ts->cond, &ts->mutex); }
+    int more = ts->head > ts->tail;
+    pthread_mutex_unlock(&ts->mutex);
+    return more;
+}
+
+void close_token_stream(TokenStream* ts) {
+    if (ts->started) {
+        pthread_mutex_lock(&ts->mutex);
+        ts->stop = 1;
+        pthread_cond_broadcast(&ts->cond);
+        pthread_mutex_unlock(&ts->mutex);
+        pthread_join(ts->thread, NULL);
+    }
+    for (int f = 0; f < ts->n_files; f++) {
+        if (ts->data[f]) { munmap(ts->data[f], ts->size[f]); }
+    }
+    pthread_mutex_destroy(&ts->mutex);
+    pthread_cond_destroy(&ts->cond);
+    free(ts->data);
+    free(ts->size);
+    free(ts->ring);
+}
+
+// ----------------------------------------------------------------------------
+// paged kv cache: blocks handed out to sequences on demand, full blocks shared by prefix
+
+// prefixes are identified by a chained FNV-1a hash over their tokens, one block at a time
+#define PREFIX_HASH_INIT 0xcbf29ce484222325ULL
+
+uint64_t prefix_hash(uint64_t h, int* tokens, int n) {
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < 4; j++) {
+            h ^= (tokens[i] >> (8 * j)) & 0xff;
+            h *= 0x100000001b3ULL;
         }
-        fseek(train_file, 0, SEEK_END);
-        long length = ftell(train_file);
-        fseek(train_file, 0, SEEK_SET);
-        char* train_text = malloc(length);
-        if (fread(train_text, 1, length, train_file) != length) {
-            printf("Failed to read train.txt\n");
-            return 1;
+    }
+    return h ? h : 1; // 0 marks a block without a reusable prefix
+}
+
+typedef struct {
+    int n_blocks;
+    int* refs;      // (n_blocks,) number of block tables holding the block
+    // unreferenced blocks, least recently released first. they keep their contents
+    // and their prefix hash until they are handed out again, so a prefix can be
+    // picked up by a later request even after every sequence using it is done
+    int* prev;      // (n_blocks,)
+    int* next;      // (n_blocks,)
+    int free_head;
+    int free_tail;
+    int n_free;
+    int n_reserved; // free blocks promised to the admitted sequences
+    uint64_t* hash; // (n_blocks,) prefix hash of every position up to the end of a full block, 0 if none
+    int* tokens;    // (n_blocks, KV_BLOCK) the tokens of a full block, to confirm a hash match
+    // open-addressed table of the blocks with a hash, linearly probed from their hash. -1 is empty
+    int* index;     // (index_mask + 1,) at least twice n_blocks, so that probes stay short
+    int index_mask;
+} KVAllocator;
+
+void kv_free_push(KVAllocator* a, int b) {
+    a->prev[b] = a->free_tail;
+    a->next[b] = -1;
+    if (a->free_tail >= 0) { a->next[a->free_tail] = b; } else { a->free_head = b; }
+    a->free_tail = b;
+    a->n_free++;
+}
+
+void kv_free_remove(KVAllocator* a, int b) {
+    if (a->prev[b] >= 0) { a->next[a->prev[b]] = a->next[b]; } else { a->free_head = a->next[b]; }
+    if (a->next[b] >= 0) { a->prev[a->next[b]] = a->prev[b]; } else { a->free_tail = a->prev[b]; }
+    a->n_free--;
+}
+
+void malloc_kv_allocator(KVAllocator* a, int n_blocks) {
+    a->n_blocks = n_blocks;
+    a->refs = calloc(n_blocks, sizeof(int));
+    a->prev = malloc(n_blocks * sizeof(int));
+    a->next = malloc(n_blocks * sizeof(int));
+    a->hash = calloc(n_blocks, sizeof(uint64_t));
+    a->tokens = malloc((size_t)n_blocks * KV_BLOCK * sizeof(int));
+    int index_size = 1;
+    while (index_size < 2 * n_blocks) { index_size *= 2; }
+    a->index = malloc(index_size * sizeof(int));
+    a->index_mask = index_size - 1;
+    if (!a->refs || !a->prev || !a->next || !a->hash || !a->tokens || !a->index) {
+        printf("malloc failed!\n");
+        exit(1);
+    }
+    a->free_head = a->free_tail = -1;
+    a->n_free = 0;
+    a->n_reserved = 0;
+    for (int b = 0; b < n_blocks; b++) { kv_free_push(a, b); }
+    for (int i = 0; i < index_size; i++) { a->index[i] = -1; }
+}
+
+void free_kv_allocator(KVAllocator* a) {
+    free(a->refs);
+    free(a->prev);
+    free(a->next);
+    free(a->hash);
+    free(a->tokens);
+    free(a->index);
+}
+
+int kv_find_block(KVAllocator* a, uint64_t h, int* tokens) {
+    // find a full block holding the prefix with hash h, ending in tokens. -1 if there is none
+    for (int i = h & a->index_mask; a->index[i] != -1; i = (i + 1) & a->index_mask) {
+        int b = a->index[i];
+        if (a->hash[b] == h && memcmp(a->tokens + (size_t)b * KV_BLOCK, tokens, KV_BLOCK * sizeof(int)) == 0) {
+            return b;
         }
-        fclose(train_file);
-        
-        // float* dweightsacc_ptr = calloc(file_size - sizeof(Config)/sizeof(float));
-
-        // greedily match with vocab
-        for (int i = 0; i < length && pos < steps; ) {
-            int maxlen = -1;
-            int maxj = -1;
-
-            for (int j = 0; j < config.vocab_size; j++) {
-                int len = strlen(vocab[j]);
-                // 
-                if (strncmp(&train_text[i], vocab[j], len) == 0 && len > maxlen) {
-                    maxlen = len;
-                    maxj = j;
-                }
+    }
+    return -1;
+}
+
+void kv_index_insert(KVAllocator* a, int b) {
+    int i = a->hash[b] & a->index_mask;
+    while (a->index[i] != -1) { i = (i + 1) & a->index_mask; }
+    a->index[i] = b;
+}
+
+void kv_index_remove(KVAllocator* a, int b) {
+    int i = a->hash[b] & a->index_mask;
+    while (a->index[i] != b) { i = (i + 1) & a->index_mask; }
+    // shift back the later entries of the run that can't be reached past the hole anymore
+    for (int j = (i + 1) & a->index_mask; a->index[j] != -1; j = (j + 1) & a->index_mask) {
+        int home = a->hash[a->index[j]] & a->index_mask;
+        int reachable = i <= j ? i < home && home <= j : i < home || home <= j;
+        if (!reachable) {
+            a->index[i] = a->index[j];
+            i = j;
+        }
+    }
+    a->index[i] = -1;
+}
+
+void kv_retain(KVAllocator* a, int b) {
+    if (a->refs[b]++ == 0) { kv_free_remove(a, b); }
+}
+
+void kv_release(KVAllocator* a, int b) {
+    if (--a->refs[b] == 0) { kv_free_push(a, b); }
+}
+
+int kv_take_block(KVAllocator* a) {
+    // hand out the least recently released block, dropping the prefix it held
+    int b = a->free_head;
+    kv_retain(a, b);
+    if (a->hash[b] != 0) { kv_index_remove(a, b); }
+    a->hash[b] = 0;
+    return b;
+}
+
+void kv_prepare_write(KVAllocator* a, RunState* s, int slot, int pos, int* reserved) {
+    // make sure the block for position pos of slot exists and can be written. blocks shared with
+    // another sequence, or registered as a reusable prefix, are read-only: copy them first
+    int* entry = &s->block_table[slot * s->max_blocks + pos / KV_BLOCK];
+    if (*entry >= 0 && a->refs[*entry] == 1 && a->hash[*entry] == 0) { return; }
+    int b = kv_take_block(a);
+    a->n_reserved--;
+    (*reserved)--;
+    if (*entry >= 0) {
+        size_t block_bytes = s->kv_bytes / s->n_blocks;
+        memcpy((char*)s->key_cache + b * block_bytes, (char*)s->key_cache + *entry * block_bytes, block_bytes);
+        memcpy((char*)s->value_cache + b * block_bytes, (char*)s->value_cache + *entry * block_bytes, block_bytes);
+        kv_release(a, *entry);
+    }
+    *entry = b;
+}
+
+void kv_register_block(KVAllocator* a, RunState* s, int slot, int block, uint64_t h, int* tokens) {
+    // a block was just filled, let later sequences with the same prefix reuse it
+    int b = s->block_table[slot * s->max_blocks + block];
+    if (a->hash[b] != 0) { return; }
+    a->hash[b] = h;
+    memcpy(a->tokens + (size_t)b * KV_BLOCK, tokens, KV_BLOCK * sizeof(int));
+    kv_index_insert(a, b);
+}
+
+void kv_release_slot(KVAllocator* a, RunState* s, int slot) {
+    int* table = s->block_table + slot * s->max_blocks;
+    for (int i = 0; i < s->max_blocks; i++) {
+        if (table[i] >= 0) { kv_release(a, table[i]); }
+        table[i] = -1;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// kv cache snapshots: the kv cache of a prompt prefix saved to disk, to skip its prefill
+
+// snapshots start with this magic number, "kv42" in ASCII
+#define SNAPSHOT_MAGIC 0x6b763432
+// the kv blocks start at a multiple of this in the file, so that any page size can map them
+#define SNAPSHOT_ALIGN 65536
+
+typedef struct {
+    uint32_t magic;
+    int version;
+    long model_size;  // size and modification time of the checkpoint file the kv was computed with
+    long model_mtime;
+    Config config;
+    int kv_block;     // KV_BLOCK of the writer
+    int dtype;        // the CheckpointDtype of the weights it was computed with
+    int kv_dtype;     // and of the kv cache itself
+    int n_tokens;     // length of the prefix, its tokens follow the header
+} SnapshotHeader;
+
+void snapshot_path(char* path, size_t size, char* dir, int* tokens, int n_tokens) {
+    // snapshot files are named by the hash of their prefix
+    snprintf(path, size, "%s/%016llx.kv", dir, (unsigned long long)prefix_hash(PREFIX_HASH_INIT, tokens, n_tokens));
+}
+
+int save_run_state(RunState* s, char* dir, SnapshotHeader* model, int* tokens, int n_tokens) {
+    // save the kv cache of the first n_tokens positions of slot 0, which must have the fixed block
+    // table of malloc_run_state with n_blocks 0. the file is written under a temporary name and
+    // renamed into place, so that a concurrent restore never sees a partial snapshot
+    SnapshotHeader h = *model;
+    h.n_tokens = n_tokens;
+    size_t bytes = (size_t)(n_tokens + KV_BLOCK - 1) / KV_BLOCK * (s->kv_bytes / s->n_blocks);
+    long data_offset = (sizeof(h) + n_tokens * sizeof(int) + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+    char path[4096], tmp[4200];
+    snapshot_path(path, sizeof(path), dir, tokens, n_tokens);
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    FILE* file = fopen(tmp, "wb");
+    if (!file) { return 0; }
+    int ok = fwrite(&h, sizeof(h), 1, file) == 1
+          && fwrite(tokens, sizeof(int), n_tokens, file) == (size_t)n_tokens
+          && fseek(file, data_offset, SEEK_SET) == 0
+          && fwrite(s->key_cache, 1, bytes, file) == bytes
+          && fwrite(s->value_cache, 1, bytes, file) == bytes;
+    ok = fclose(file) == 0 && ok;
+    if (ok) { ok = rename(tmp, path) == 0; }
+    if (!ok) { unlink(tmp); }
+    return ok;
+}
+
+int restore_run_state(RunState* s, char* dir, SnapshotHeader* model, int* tokens, int n_tokens) {
+    // the counterpart of save_run_state: fill the kv cache of slot 0 with the snapshot of exactly
+    // these n_tokens tokens, computed by the same model. returns 0 if there is none, then
+    // generation has to start from position 0, else it can continue at position n_tokens
+    char path[4096];
+    snapshot_path(path, sizeof(path), dir, tokens, n_tokens);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) { return 0; }
+    SnapshotHeader h;
+    int* file_tokens = malloc(n_tokens * sizeof(int));
+    if (!file_tokens) { printf("malloc failed!\n"); exit(1); }
+    size_t bytes = (size_t)(n_tokens + KV_BLOCK - 1) / KV_BLOCK * (s->kv_bytes / s->n_blocks);
+    long data_offset = (sizeof(h) + n_tokens * sizeof(int) + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+    SnapshotHeader expected = *model;
+    expected.n_tokens = n_tokens;
+    int ok = pread(fd, &h, sizeof(h), 0) == sizeof(h)
+          && memcmp(&h, &expected, sizeof(h)) == 0
+          && pread(fd, file_tokens, n_tokens * sizeof(int), sizeof(h)) == (ssize_t)(n_tokens * sizeof(int))
+          && memcmp(file_tokens, tokens, n_tokens * sizeof(int)) == 0
+          && lseek(fd, 0, SEEK_END) >= data_offset + 2 * (long)bytes;
+    free(file_tokens);
+    if (ok) {
+        long page = sysconf(_SC_PAGESIZE);
+        if (bytes % page == 0 && data_offset % page == 0) {
+            // map the snapshot over the start of the pools. pages are read in the first time
+            // attention touches them and copied the first time they are written, like the weights
+            ok = mmap(s->key_cache, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, data_offset) != MAP_FAILED
+              && mmap(s->value_cache, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, data_offset + bytes) != MAP_FAILED;
+        } else {
+            ok = pread(fd, s->key_cache, bytes, data_offset) == (ssize_t)bytes
+              && pread(fd, s->value_cache, bytes, data_offset + bytes) == (ssize_t)bytes;
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// speculative decoding: a small draft model proposes tokens, the model checks them all in one pass
+
+void speculate(Config* p, RunState* s, TransformerWeights* w, QuantizedWeights* qw,
+               Config* dp, RunState* ds, TransformerWeights* dw, QuantizedWeights* dqw,
+               Sampler* sampler, uint64_t* rng, char** vocab, int* tokens, int pos, int steps, int n_draft,
+               long* n_drafted, long* n_accepted) {
+    // generate tokens[pos + 1..steps], where tokens[pos] is the current token that isn't forwarded
+    // yet. each round the draft model (int8 if dqw) samples up to n_draft tokens one at a time, then
+    // the model (int8 if qw) forwards the current token and all the drafts in a single pass, which
+    // streams its weights once like a prefill chunk. the drafts are kept up to the first one that
+    // fails the speculative sampling test, and that one is resampled from what the model's
+    // distribution has left over the draft's. this gives exactly the model's own distribution,
+    // and at temperature 0 exactly its greedy output. rejected positions need no cleanup in either
+    // kv cache: pos rolls back and the next pass overwrites them
+    int vocab_size = p->vocab_size;
+    float* q = malloc((size_t)n_draft * vocab_size * sizeof(float)); // draft distribution per drafted token
+    float* probs = malloc(vocab_size * sizeof(float));
+    if (!q || !probs) {
+        printf("malloc failed!\n");
+        exit(1);
+    }
+    int slots[MAX_CHUNK];
+    int positions[MAX_CHUNK];
+    int dpos = 0; // tokens[0..dpos) are in the draft's kv cache
+    while (pos < steps) {
+        // the drafts go at positions pos + 1..pos + k, and every token is forwarded at positions < steps
+        int k = n_draft < steps - 1 - pos ? n_draft : steps - 1 - pos;
+        for (int i = 0; i < k; i++) {
+            // the draft forwards what it hasn't seen through tokens[pos + i], then samples the next
+            while (dpos <= pos + i) {
+                int nt = pos + i + 1 - dpos < MAX_CHUNK ? pos + i + 1 - dpos : MAX_CHUNK;
+                forward_chunk(tokens + dpos, nt, dpos, dp, ds, dw, dqw);
+                dpos += nt;
             }
-            // printf("Matched token %d = '%s' at position %d with length %d\n", maxj, vocab[maxj], i, maxlen);
+            sampler_probs(sampler, ds->logits, q + (size_t)i * vocab_size);
+            tokens[pos + 1 + i] = sample(q + (size_t)i * vocab_size, vocab_size, rng);
+        }
+        // the model's logits after the current token and after each draft
+        for (int t = 0; t <= k; t++) {
+            slots[t] = 0;
+            positions[t] = pos + t;
+        }
+        forward_rows(tokens + pos, slots, positions, k + 1, 1, p, s, w, qw);
+        // keep draft i with probability min(1, p(d) / q(d)), else resample from max(0, p - q)
+        int a = 0;
+        for (; a < k; a++) {
+            float* qa = q + (size_t)a * vocab_size;
+            int d = tokens[pos + 1 + a];
+            sampler_probs(sampler, s->logits + (size_t)a * vocab_size, probs);
+            if (random_f32(rng) * qa[d] < probs[d]) { continue; }
+            for (int i = 0; i < vocab_size; i++) {
+                probs[i] = probs[i] > qa[i] ? probs[i] - qa[i] : 0.0f;
+            }
+            break;
+        }
+        if (a == k) {
+            // every draft was kept, so the model gets to sample one more token for free
+            sampler_probs(sampler, s->logits + (size_t)k * vocab_size, probs);
+        }
+        tokens[pos + 1 + a] = sample(probs, vocab_size, rng);
+        for (int i = 1; i <= a + 1; i++) { printf("%s", vocab[tokens[pos + i]]); }
+        fflush(stdout);
+        *n_drafted += k;
+        *n_accepted += a;
+        pos += a + 1;
+        // the draft's entries from the first rejected position on are stale
+        if (dpos > pos) { dpos = pos; }
+    }
+    free(q);
+    free(probs);
+}
+
+// ----------------------------------------------------------------------------
+// self-check: the forward pass of inference against the one fine-tuning differentiates
+
+float check_forward(Config* p, TransformerWeights* w, int n, uint64_t seed) {
+    // the largest difference between the logits of forward_rows, which runs on the thread pool,
+    // and of transformer_rows, which Enzyme differentiates, over n random tokens of one sequence.
+    // they are separate code, this keeps them the same model. the chunks vary in size, so that
+    // both single tokens and full chunks are covered, and every row gets logits
+    RunState a, b;
+    malloc_run_state(&a, p, 1, 0, DTYPE_FP32);
+    malloc_run_state(&b, p, 1, 0, DTYPE_FP32);
+    uint64_t rng = seed * 0x9E3779B97F4A7C15ULL | 1; // any nonzero state works for xorshift
+    int tokens[MAX_CHUNK], slots[MAX_CHUNK], positions[MAX_CHUNK];
+    float max_diff = 0.0f;
+    for (int pos = 0; pos < n; ) {
+        int nt = 1 + random_u32(&rng) % MAX_CHUNK;
+        if (nt > n - pos) { nt = n - pos; }
+        for (int t = 0; t < nt; t++) {
+            tokens[t] = random_u32(&rng) % p->vocab_size;
+            slots[t] = 0;
+            positions[t] = pos + t;
+        }
+        forward_rows(tokens, slots, positions, nt, 1, p, &a, w, NULL);
+        transformer_rows(tokens, slots, positions, nt, 1, p, &b, w, NULL);
+        for (size_t i = 0; i < (size_t)nt * p->vocab_size; i++) {
+            float d = fabsf(a.logits[i] - b.logits[i]);
+            if (!(d <= max_diff)) { max_diff = d; } // NaNs count as a difference too
+        }
+        pos += nt;
+    }
+    free_run_state(&a);
+    free_run_state(&b);
+    return max_diff;
+}
 
-            i += maxlen;
-            
-            
-            int nexttok = maxj;
+// ----------------------------------------------------------------------------
+// benchmark mode: prefill, decode and time to first token, with the per-op profile
 
-            // transformer(token, pos, &config, &state, &weights);
+int compare_longs(const void* a, const void* b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return (x > y) - (x < y);
+}
 
-            double lres = __enzyme_autodiff((void*)loss,
-                                enzyme_primal_return,
-                                enzyme_const, token,
-                                enzyme_const, pos,
-                                enzyme_const, &config,
-                                enzyme_dup, &state, &dstate, 
-                                enzyme_dup, &weights , &dweights,
-                                nexttok,
-                                enzyme_const, temperature);
+long median(long* v, int n) {
+    qsort(v, n, sizeof(long), compare_longs);
+    return v[n / 2];
+}
 
-            printf("%s %d %f\n", vocab[nexttok], pos, lres);
-            fflush(stdout);
+void bench(Config* p, RunState* s, TransformerWeights* w, QuantizedWeights* qw, VocabTrie* trie, Sampler* sampler,
+           uint64_t seed, char* prompt, int steps, int warmup, int repeat, char* checkpoint) {
+    // generate up to position steps warmup + repeat times, from the same prompt (or from steps / 2
+    // random tokens without one) prefilled in chunks, with the same samples. prefill, time to first
+    // token and decode are the medians over the repeats, the ops are profiled over all of them.
+    // reported as a table on stderr, and as one line of json on stdout
+    int* tokens = malloc((steps + 1) * sizeof(int));
+    long* times = malloc(3 * repeat * sizeof(long)); // prefill, ttft and decode of each repeat
+    if (!tokens || !times) { printf("malloc failed!\n"); exit(1); }
+    uint64_t rng = seed * 0x9E3779B97F4A7C15ULL | 1; // any nonzero state works for xorshift
+    tokens[0] = 1; // BOS
+    int n_prompt = 1;
+    long len = prompt ? strlen(prompt) : 0;
+    n_prompt += tokenize(trie, prompt, len, &tokens[n_prompt], steps - n_prompt, NULL);
+    while (!prompt && n_prompt < steps / 2) { tokens[n_prompt++] = 1 + random_u32(&rng) % (p->vocab_size - 1); }
 
-            for (size_t i =0, end=(file_size - sizeof(Config))/sizeof(float); i<end; i++) {
-                if (fabs(dweights_ptr[i]) > 1000 || isnan(dweights_ptr[i])) {
-                    printf("%i %f\n", i, dweights_ptr[i]);
-                    exit(1);
+    for (int r = -warmup; r < repeat; r++) {
+        if (r == 0) { profile_reset(); } // the warmup runs don't count
+        uint64_t run_rng = rng;
+        long t0 = time_in_ns();
+        for (int pos = 0; pos < n_prompt; pos += MAX_CHUNK) {
+            int nt = n_prompt - pos < MAX_CHUNK ? n_prompt - pos : MAX_CHUNK;
+            forward_chunk(tokens + pos, nt, pos, p, s, w, qw);
+        }
+        long t1 = time_in_ns();
+        int token = sample_logits(sampler, s->logits, &run_rng);
+        long t2 = time_in_ns();
+        for (int pos = n_prompt; pos < steps; pos++) {
+            forward_chunk(&token, 1, pos, p, s, w, qw);
+            token = sample_logits(sampler, s->logits, &run_rng);
+        }
+        long t3 = time_in_ns();
+        if (r >= 0) {
+            times[r] = t1 - t0;
+            times[repeat + r] = t2 - t0;
+            times[2 * repeat + r] = t3 - t2;
+        }
+    }
+
+    double prefill_ms = median(times, repeat) / 1e6;
+    double ttft_ms = median(times + repeat, repeat) / 1e6;
+    double decode_ms = median(times + 2 * repeat, repeat) / 1e6;
+    int n_decode = steps - n_prompt;
+    double prefill_rate = prefill_ms > 0 ? n_prompt / prefill_ms * 1000 : 0.0;
+    double decode_rate = decode_ms > 0 ? n_decode / decode_ms * 1000 : 0.0;
+    fprintf(stderr, "prefill %d tokens in %.3f ms (%.2f tok/s), time to first token %.3f ms, "
+            "decode %d tokens in %.3f ms (%.2f tok/s), median of %d runs after %d warmup\n",
+            n_prompt, prefill_ms, prefill_rate, ttft_ms, n_decode, decode_ms, decode_rate, repeat, warmup);
+    printf("{\"bench\": \"generate\", \"model\": \"%s\", \"threads\": %d, \"dtype\": \"%s\", \"kv_dtype\": \"%s\", "
+           "\"warmup\": %d, "
+           "\"repeat\": %d, \"prefill_tokens\": %d, \"decode_tokens\": %d, \"prefill_ms\": %.6f, \"ttft_ms\": %.6f, "
+           "\"decode_ms\": %.6f, \"prefill_tok_s\": %.3f, \"decode_tok_s\": %.3f, ", checkpoint,
+           pool.n_threads > 1 ? pool.n_threads : 1, dtype_names[qw ? qw->dtype : DTYPE_FP32],
+           dtype_names[s->kv_dtype], warmup, repeat, n_prompt, n_decode,
+           prefill_ms, ttft_ms, decode_ms, prefill_rate, decode_rate);
+    profile_report(OP_RMSNORM, OP_TRAIN_FORWARD, repeat, "op");
+    printf("}\n");
+    free(tokens);
+    free(times);
+}
+
+// ----------------------------------------------------------------------------
+// server mode: continuous batching of many sequences through one forward pass
+
+typedef struct {
+    int id;       // request number, in order of arrival
+    int* tokens;  // (steps+1,) BOS, the prompt and then the generated tokens. NULL if the slot is free
+    int n_tokens; // number of tokens in tokens
+    int pos;      // number of tokens already forwarded into this sequence's kv cache
+    int reserved; // kv blocks set aside for this sequence that it hasn't taken yet
+    int n_hashed; // number of its full blocks covered by hash
+    uint64_t hash; // prefix hash of its first n_hashed blocks
+    uint64_t rng; // its own random state, so that its samples don't depend on the rest of the batch
+} Sequence;
+
+int read_request(Sequence* seq, int id, VocabTrie* trie, int steps, uint64_t seed, int block) {
+    // read one prompt line from stdin into seq. without block, only if a line is waiting.
+    // returns 0 on EOF or when nothing is waiting
+    if (!block) {
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        if (poll(&pfd, 1, 0) <= 0) { return 0; }
+    }
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len = getline(&line, &cap, stdin);
+    if (len < 0) { free(line); return 0; }
+    if (len > 0 && line[len - 1] == '\n') { line[--len] = '\0'; }
+    seq->id = id;
+    seq->rng = (seed + id) * 0x9E3779B97F4A7C15ULL | 1; // any nonzero state works for xorshift
+    seq->tokens = malloc((steps + 1) * sizeof(int));
+    if (!seq->tokens) { printf("malloc failed!\n"); exit(1); }
+    seq->tokens[0] = 1; // BOS
+    seq->n_tokens = 1;
+    // greedily tokenize the prompt, like --prompt it can take up to steps positions
+    seq->n_tokens += tokenize(trie, line, len, &seq->tokens[seq->n_tokens], steps - seq->n_tokens, NULL);
+    free(line);
+    return 1;
+}
+
+int kv_admit(KVAllocator* a, RunState* s, int slot, Sequence* seq, int steps) {
+    // give seq the kv slot, reusing the cached blocks of the longest prefix of its prompt that
+    // has them, so that prefill starts after it. returns 0, leaving everything untouched, if the
+    // free blocks can't cover all the blocks the sequence may still need for its steps
+    int* table = s->block_table + slot * s->max_blocks;
+    uint64_t h = PREFIX_HASH_INIT;
+    int n_shared = 0;
+    int n_unreferenced = 0; // shared blocks that are now on the free list
+    while ((n_shared + 1) * KV_BLOCK <= seq->n_tokens) {
+        int* block_tokens = seq->tokens + n_shared * KV_BLOCK;
+        uint64_t hn = prefix_hash(h, block_tokens, KV_BLOCK);
+        int b = kv_find_block(a, hn, block_tokens);
+        if (b < 0) { break; }
+        if (a->refs[b] == 0) { n_unreferenced++; }
+        table[n_shared++] = b;
+        h = hn;
+    }
+    // the last prompt token is always forwarded, it gives the logits of the first new token
+    int start = n_shared * KV_BLOCK < seq->n_tokens ? n_shared * KV_BLOCK : seq->n_tokens - 1;
+    // every block from the one holding start to the one holding steps-1 may need a fresh block:
+    // a new one, or the copy of a shared one on its first write
+    int need = (steps - 1) / KV_BLOCK - start / KV_BLOCK + 1;
+    if (a->n_free - n_unreferenced - a->n_reserved < need) {
+        for (int i = 0; i < n_shared; i++) { table[i] = -1; }
+        return 0;
+    }
+    for (int i = 0; i < n_shared; i++) { kv_retain(a, table[i]); }
+    a->n_reserved += need;
+    seq->reserved = need;
+    seq->pos = start;
+    seq->n_hashed = n_shared;
+    seq->hash = h;
+    return 1;
+}
+
+void serve(Config* p, RunState* s, TransformerWeights* w, QuantizedWeights* qw, char** vocab, VocabTrie* trie,
+           Sampler* sampler, uint64_t seed, int steps) {
+    // read prompts from stdin, one per line, and decode up to s->n_slots of them at once. every step
+    // stacks the current token of each active sequence (or a chunk of its prompt, while it is still
+    // prefilling) into one forward pass, so the weights are streamed once for the whole batch.
+    // new requests join and finished ones leave between steps, as long as the kv cache blocks
+    // last. each finished sequence is printed as one "id<TAB>text" line, in order of completion
+    int n_slots = s->n_slots;
+    Sequence* seqs = calloc(n_slots, sizeof(Sequence));
+    if (!seqs) { printf("malloc failed!\n"); exit(1); }
+    Sequence waiting = { .tokens = NULL }; // a request that was read but not admitted yet
+    KVAllocator kv;
+    malloc_kv_allocator(&kv, s->n_blocks);
+    int tokens[MAX_CHUNK], slots[MAX_CHUNK], pos[MAX_CHUNK];
+    int n_active = 0, n_requests = 0, eof = 0;
+    long n_forwarded = 0, n_reused = 0;
+    long start = time_in_ms();
+    setvbuf(stdin, NULL, _IONBF, 0); // so that poll sees every line that wasn't consumed yet
+
+    while (n_active > 0 || waiting.tokens || !eof) {
+        // admit new requests into free slots, waiting for one only if there is nothing else to do
+        for (int i = 0; i < n_slots; i++) {
+            if (seqs[i].tokens) { continue; }
+            if (!waiting.tokens) {
+                if (eof || !read_request(&waiting, n_requests, trie, steps, seed, n_active == 0)) {
+                    if (n_active == 0) { eof = 1; }
+                    break;
                 }
-                if (fabs(dweights_ptr[i]) > 1e-2) {
-                    printf("%i %f %d\n", i, dweights_ptr[i], pos);
+                n_requests++;
+            }
+            if (!kv_admit(&kv, s, i, &waiting, steps)) {
+                if (n_active == 0) {
+                    printf("%d kv cache blocks are too few for a sequence of %d steps\n", s->n_blocks, steps);
+                    exit(1);
                 }
-                weights_ptr[i] += alpha * dweights_ptr[i];
-                dweights_ptr[i] = 0;
+                break;
             }
-            zero_run_state(&dstate, &config);
+            n_reused += waiting.pos;
+            seqs[i] = waiting;
+            waiting.tokens = NULL;
+            n_active++;
+        }
+        if (n_active == 0) { continue; }
 
-            token = maxj;
-            pos++;
-            // break;
+        // every active sequence forwards one token, the rows left over go to prompt prefill
+        int nt = 0;
+        int spare = MAX_CHUNK - n_active;
+        for (int i = 0; i < n_slots; i++) {
+            Sequence* seq = &seqs[i];
+            if (!seq->tokens) { continue; }
+            int take = seq->n_tokens - seq->pos;
+            if (take > 1 + spare) { take = 1 + spare; }
+            spare -= take - 1;
+            for (int j = 0; j < take; j++) {
+                kv_prepare_write(&kv, s, i, seq->pos, &seq->reserved);
+                tokens[nt] = seq->tokens[seq->pos];
+                slots[nt] = i;
+                pos[nt] = seq->pos++;
+                nt++;
+            }
+        }
+        forward_rows(tokens, slots, pos, nt, 0, p, s, w, qw);
+        n_forwarded += nt;
 
+        // sample the next token of every sequence whose whole input has been forwarded
+        int k = 0;
+        for (int i = 0; i < n_slots; i++) {
+            Sequence* seq = &seqs[i];
+            if (!seq->tokens) { continue; }
+            float* logits = s->logits + (k++) * p->vocab_size;
+            // the blocks this step filled can now be shared with later requests
+            while ((seq->n_hashed + 1) * KV_BLOCK <= seq->pos) {
+                int* block_tokens = seq->tokens + seq->n_hashed * KV_BLOCK;
+                seq->hash = prefix_hash(seq->hash, block_tokens, KV_BLOCK);
+                kv_register_block(&kv, s, i, seq->n_hashed++, seq->hash, block_tokens);
+            }
+            if (seq->pos < seq->n_tokens) { continue; } // still prefilling
+            int next = sample_logits(sampler, logits, &seq->rng);
+            // the model emits BOS between stories, treat it as the end of the sequence
+            if (next != 1) { seq->tokens[seq->n_tokens++] = next; }
+            // as in the single sequence loop, the token sampled at position steps-1 is the last one
+            if (next == 1 || seq->n_tokens == steps + 1) {
+                printf("%d\t", seq->id);
+                for (int j = 1; j < seq->n_tokens; j++) { printf("%s", vocab[seq->tokens[j]]); }
+                printf("\n");
+                fflush(stdout);
+                kv_release_slot(&kv, s, i);
+                kv.n_reserved -= seq->reserved;
+                free(seq->tokens);
+                seq->tokens = NULL;
+                n_active--;
+            }
         }
+    }
 
-        printf("\n\nFinished fine-tuning.\n\n");
+    long end = time_in_ms();
+    fprintf(stderr, "served %d requests, reused %ld cached prompt tokens, achieved tok/s: %f\n",
+            n_requests, n_reused, n_forwarded / (double)(end-start)*1000);
+    free_kv_allocator(&kv);
+    free(seqs);
+}
 
-        pos = 0;
-        zero_run_state(&state, &config);
-        token = 1;
-        printf("<s>\n"); // explicit print the initial BOS token (=1), stylistically symmetric
+int main(int argc, char *argv[]) {
+
+    // poor man's C argparse
+    char *checkpoint = NULL;  // e.g. out/model.bin
+    float temperature = 0.9f; // e.g. 1.0, or 0.0
+    int topk = 0;             // --top-k N: sample only from the N most likely tokens, 0: all
+    float topp = 1.0f;        // --top-p f: sample only from the most likely tokens making up f of the probability
+    uint64_t rng_seed = 1337; // --seed N
+    int steps = 256;          // max number of steps to run for, 0: use seq_len
+    char *training_data = NULL;
+    char *prompt = NULL;      // --prompt "text": start generation from this text, prefilled in chunks
+    char *system_prompt = NULL; // --system "text": goes before the prompt, the prefix --kv-cache snapshots
+    char *kv_cache_dir = NULL; // --kv-cache dir: save/restore the kv cache of the prompt prefix there
+    int serve_mode = 0;       // --serve: generate for every prompt line on stdin, batching them together
+    int batch = 8;            // --batch N: max number of sequences decoded at once in --serve mode
+    int kv_blocks = 0;        // --kv-blocks N: size of the --serve kv cache, 0: enough for batch full sequences
+    char *draft_checkpoint = NULL; // --draft model.bin: speculative decoding with this smaller model
+    int draft_k = 4;          // --draft-k N: number of tokens the draft model proposes per step
+    int tokenize_only = 0;    // --tokenize-only: just tokenize training_data, report timing and exit
+    SimdLevel max_simd = SIMD_AVX512; // --simd scalar|avx2|avx512: cap the dot product kernels used
+    int n_threads = 0;        // --threads N: threads running the forward pass, 0: one per cpu
+    int numa = 0;             // --numa: spread the threads over the numa nodes, each next to its weight rows
+    int prefault_weights = 0; // --prefault: read the whole checkpoint in at load time, on all threads
+    int hugepages = 0;        // --hugepages: ask for transparent huge pages for the checkpoint mapping
+    int grad_accum = 1;       // --grad-accum N: accumulate gradients over N tokens per weight update
+    int train_seq = 1;        // --train-seq N: positions differentiated together in one backward pass
+    int recompute = 0;        // --recompute: keep only each layer's input, recompute the rest in the backward pass
+    int n_workers = 1;        // --workers N: data parallel fine-tuning over N processes
+    int reduce_bf16 = 0;      // --reduce-bf16: all-reduce the gradients of --workers in bf16
+    int freeze_embeddings = 0; // --freeze-embeddings: train everything but the token embeddings
+    int freeze_layers = 0;    // --freeze-layers N: don't train the first N layers
+    char *lora_path = NULL;   // --lora file: adapters merged into the weights, or trained further
+    int lora_rank = 0;        // --lora-rank N: fine-tune rank N adapters instead of the weights
+    float lora_alpha = 0.0f;  // --lora-alpha f: the adapters are scaled by alpha / rank, 0: by 1
+    int lora_ffn = 0;         // --lora-ffn: adapt w1, w2, w3 too, not only the attention matmuls
+    char *lora_out = NULL;    // --lora-out file: save the fine-tuned adapters there
+    int ctx = 0;              // --ctx N: context length to run with, 0: the seq_len the model was exported with
+    RopeScaling rope_scaling = ROPE_NTK; // --rope-scaling none|linear|ntk: for a --ctx past that seq_len
+    int ring = 0;             // --ring: generate past seq_len, the kv cache a ring of the latest positions
+    int n_sink = 4;           // --sinks N: the first N positions stay in the --ring cache
+    int bench_mode = 0;       // --bench: time prefill, decode and each op of the forward pass, and of fine-tuning
+    int bench_warmup = 1;     // --bench-warmup N: untimed runs (or fine-tuning windows) first
+    int bench_repeat = 5;     // --bench-repeat N: timed generation runs
+    int kv_dtype = DTYPE_FP32; // --kv-dtype fp32|fp16|bf16: the storage of the inference kv cache
+    int check = 0;            // --check-forward: compare the two forward passes over steps positions, and exit
+    // --optimizer sgd|adamw, --lr, --momentum, --weight-decay, --grad-clip
+    Optimizer opt = { .type = OPT_SGD, .lr = 0.0f, .momentum = 0.0f, .beta1 = 0.9f, .beta2 = 0.95f,
+                      .eps = 1e-8f, .weight_decay = 0.0f, .grad_clip = 0.0f };
+    // --flags may appear anywhere, everything else is positional
+    int npos = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0) {
+            if (strcmp(argv[i], "--tokenize-only") == 0) { tokenize_only = 1; }
+            else if (strcmp(argv[i], "--prompt") == 0 && i + 1 < argc) { prompt = argv[++i]; }
+            else if (strcmp(argv[i], "--system") == 0 && i + 1 < argc) { system_prompt = argv[++i]; }
+            else if (strcmp(argv[i], "--top-k") == 0 && i + 1 < argc) { topk = atoi(argv[++i]); }
+            else if (strcmp(argv[i], "--top-p") == 0 && i + 1 < argc) { topp = atof(argv[++i]); }
+            else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) { rng_seed = strtoull(argv[++i], NULL, 10); }
+            else if (strcmp(argv[i], "--kv-cache") == 0 && i + 1 < argc) { kv_cache_dir = argv[++i]; }
+            else if (strcmp(argv[i], "--serve") == 0) { serve_mode = 1; }
+            else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) { batch = atoi(argv[++i]); }
+            else if (strcmp(argv[i], "--kv-blocks") == 0 && i + 1 < argc) { kv_blocks = atoi(argv[++i]); }
+            else if (strcmp(argv[i], "--draft") == 0 && i + 1 < argc) { draft_checkpoint = argv[++i]; }
+            else if (strcmp(argv[i], "--draft-k") == 0 && i + 1 < argc) { draft_k = atoi(argv[++i]); }
+            else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) { n_threads = atoi(argv[++i]); }
+            else if (strcmp(argv[i], "--numa") == 0) { numa = 1; }
+            else if (strcmp(argv[i], "--prefault") == 0) { prefault_weights = 1; }
+            else if (strcmp(argv[i], "--hugepages") == 0) { hugepages = 1; }
+            else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+                i++;
+                if (strcmp(argv[i], "scalar") == 0) { max_simd = SIMD_SCALAR; }
+                else if (strcmp(argv[i], "avx2") == 0) { max_simd = SIMD_AVX2; }
+                else if (strcmp(argv[i], "avx512") == 0) { max_simd = SIMD_AVX512; }
+                else { printf("Unknown simd level %s\n", argv[i]); return 1; }
+            }
+            else if (strcmp(argv[i], "--grad-accum") == 0 && i + 1 < argc) { grad_accum = atoi(argv[++i]); }
+            else if (strcmp(argv[i], "--train-seq") == 0 && i + 1 < argc) { train_seq = atoi(argv[++i]); }
+            else if (strcmp(argv[i], "--recompute") == 0) { recompute = 1; }
+            else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) { n_workers = atoi(argv[++i]); }
+            else if (strcmp(argv[i], "--reduce-bf16") == 0) { reduce_bf16 = 1; }
+            else if (strcmp(argv[i], "--freeze-embeddings") == 0) { freeze_embeddings = 1; }
+            else if (strcmp(argv[i], "--freeze-layers") == 0 && i + 1 < argc) { freeze_layers = atoi(argv[++i]); }
+            else if (strcmp(argv[i], "--lora") == 0 && i + 1 < argc) { lora_path = argv[++i]; }
+            else if (strcmp(argv[i], "--lora-rank") == 0 && i + 1 < argc) { lora_rank = atoi(argv[++i]); }
+            else if (strcmp(argv[i], "--lora-alpha") == 0 && i + 1 < argc) { lora_alpha = atof(argv[++i]); }
+            else if (strcmp(argv[i], "--lora-ffn") == 0) { lora_ffn = 1; }
+            else if (strcmp(argv[i], "--lora-out") == 0 && i + 1 < argc) { lora_out = argv[++i]; }
+            else if (strcmp(argv[i], "--ctx") == 0 && i + 1 < argc) { ctx = atoi(argv[++i]); }
+            else if (strcmp(argv[i], "--rope-scaling") == 0 && i + 1 < argc) {
+                i++;
+                if (strcmp(argv[i], "none") == 0) { rope_scaling = ROPE_NONE; }
+                else if (strcmp(argv[i], "linear") == 0) { rope_scaling = ROPE_LINEAR; }
+                else if (strcmp(argv[i], "ntk") == 0) { rope_scaling = ROPE_NTK; }
+                else { printf("Unknown rope scaling %s\n", argv[i]); return 1; }
+            }
+            else if (strcmp(argv[i], "--ring") == 0) { ring = 1; }
+            else if (strcmp(argv[i], "--sinks") == 0 && i + 1 < argc) { n_sink = atoi(argv[++i]); }
+            else if (strcmp(argv[i], "--bench") == 0) { bench_mode = 1; }
+            else if (strcmp(argv[i], "--check-forward") == 0) { check = 1; }
+            else if (strcmp(argv[i], "--bench-warmup") == 0 && i + 1 < argc) { bench_warmup = atoi(argv[++i]); }
+            else if (strcmp(argv[i], "--bench-repeat") == 0 && i + 1 < argc) { bench_repeat = atoi(argv[++i]); }
+            else if (strcmp(argv[i], "--kv-dtype") == 0 && i + 1 < argc) {
+                i++;
+                if (strcmp(argv[i], "fp32") == 0) { kv_dtype = DTYPE_FP32; }
+                else if (strcmp(argv[i], "fp16") == 0) { kv_dtype = DTYPE_F16; }
+                else if (strcmp(argv[i], "bf16") == 0) { kv_dtype = DTYPE_BF16; }
+                else { printf("Unknown kv dtype %s\n", argv[i]); return 1; }
+            }
+            else if (strcmp(argv[i], "--optimizer") == 0 && i + 1 < argc) {
+                i++;
+                if (strcmp(argv[i], "sgd") == 0) { opt.type = OPT_SGD; }
+                else if (strcmp(argv[i], "adamw") == 0) { opt.type = OPT_ADAMW; }
+                else { printf("Unknown optimizer %s\n", argv[i]); return 1; }
+            }
+            else if (strcmp(argv[i], "--lr") == 0 && i + 1 < argc) { opt.lr = atof(argv[++i]); }
+            else if (strcmp(argv[i], "--momentum") == 0 && i + 1 < argc) { opt.momentum = atof(argv[++i]); }
+            else if (strcmp(argv[i], "--weight-decay") == 0 && i + 1 < argc) { opt.weight_decay = atof(argv[++i]); }
+            else if (strcmp(argv[i], "--grad-clip") == 0 && i + 1 < argc) { opt.grad_clip = atof(argv[++i]); }
+            else { printf("Unknown flag %s\n", argv[i]); return 1; }
+            continue;
+        }
+        if (npos == 0) { checkpoint = argv[i]; }
+        // optional temperature. 0.0 = (deterministic) argmax sampling. 1.0 = baseline
+        else if (npos == 1) { temperature = atof(argv[i]); }
+        else if (npos == 2) { steps = atoi(argv[i]); }
+        else if (npos == 3) { training_data = argv[i]; }
+        npos++;
+    }
+    // 'checkpoint' is necessary arg
+    if (!checkpoint || (tokenize_only && !training_data) || grad_accum < 1 || train_seq < 1 || n_workers < 1 || n_workers > MAX_RANKS || batch < 1 || batch > MAX_CHUNK
+        || topk < 0 || topp <= 0.0f || topp > 1.0f || draft_k < 1 || draft_k >= MAX_CHUNK
+        || lora_rank < 0 || ctx < 0 || n_sink < 0 || bench_warmup < 0 || bench_repeat < 1 || lora_rank > MAX_LORA_RANK || (lora_out && !(training_data && (lora_rank > 0 || lora_path)))) {
+        printf("Usage: %s <checkpoint_file> [temperature] [steps] [training_data] [--prompt text] [--system text] [--kv-cache dir]\n"
+               "       [--top-k N] [--top-p f] [--seed N] [--serve] [--batch N] [--kv-blocks N] [--draft model.bin] [--draft-k N]\n"
+               "       [--tokenize-only] [--threads N] [--numa] [--prefault] [--hugepages] [--simd scalar|avx2|avx512] [--grad-accum N] [--train-seq N]\n"
+               "       [--recompute] [--workers N] [--reduce-bf16] [--freeze-embeddings] [--freeze-layers N]\n"
+               "       [--optimizer sgd|adamw] [--lr f] [--momentum f] [--weight-decay f] [--grad-clip f]\n"
+               "       [--lora file] [--lora-rank N] [--lora-alpha f] [--lora-ffn] [--lora-out file] [--ctx N] [--rope-scaling none|linear|ntk]\n"
+               "       [--ring] [--sinks N] [--bench] [--bench-warmup N] [--bench-repeat N] [--kv-dtype fp32|fp16|bf16]\n"
+               "       [--check-forward]\n", argv[0]);
+        return 1;
+    }
+    if (opt.lr == 0.0f) { opt.lr = opt.type == OPT_ADAMW ? 1e-4f : 1.0f; }
+    if (bench_mode && (serve_mode || draft_checkpoint || kv_cache_dir || tokenize_only)) {
+        printf("--bench times plain generation, not --serve, --draft, --kv-cache or --tokenize-only\n");
+        return 1;
+    }
+    profile.on = bench_mode;
+    init_simd(max_simd);
+    // --workers forks the ranks once the model is loaded, and a forked child only has the thread
+    // that called fork(). so then the pool gets no workers, the ranks don't use it anyway, and
+    // nothing before the fork may enter an OpenMP region either, the team wouldn't survive it
+    init_pool(training_data && n_workers > 1 ? 1 : n_threads, numa);
+
+    // the rng is seeded with a fixed --seed. if you want deterministic behavior use temperature 0.0
+    uint64_t rng_state = rng_seed * 0x9E3779B97F4A7C15ULL | 1; // any nonzero state works for xorshift
+    
+    // read in the model.bin file
+    Config config;
+    TransformerWeights weights;
+    TransformerWeights dweights;
+    QuantizedWeights qweights;
+    int quantized = 0; // 1 if the checkpoint holds int8 or 16-bit weights
+    int fd = 0;
+    float* data = NULL;
+    long file_size;
+    int shared_weights;
+    long load_start = time_in_ms();
+    // fine-tuning adapters leaves the weights alone, so their mapping stays read-only and shared.
+    // merging adapters at inference needs a private copy of the pages it writes
+    int lora_training = training_data && (lora_rank > 0 || lora_path);
+    int train_len; // the seq_len the model was exported with
+    if (read_checkpoint(checkpoint, &config, &weights, &qweights, &quantized, &shared_weights, &data, &file_size, &fd,
+                        training_data ? !lora_training : lora_path != NULL, hugepages, ctx, rope_scaling, &train_len)
+        || numa_place_weights(&config, &weights, quantized ? &qweights : NULL, &data, file_size)) {
+        return 1;
+    }
+    // the draft model for speculative decoding, int8, 16-bit or fp32 like any checkpoint
+    Config draft_config;
+    TransformerWeights draft_weights;
+    QuantizedWeights draft_qweights;
+    int draft_quantized = 0;
+    int draft_fd = -1;
+    float* draft_data = MAP_FAILED;
+    long draft_file_size;
+    int draft_shared_weights;
+    int draft_train_len;
+    if (draft_checkpoint) {
+        if (read_checkpoint(draft_checkpoint, &draft_config, &draft_weights, &draft_qweights, &draft_quantized,
+                            &draft_shared_weights, &draft_data, &draft_file_size, &draft_fd, 0, hugepages, ctx, rope_scaling,
+                            &draft_train_len)
+            || numa_place_weights(&draft_config, &draft_weights, draft_quantized ? &draft_qweights : NULL,
+                                  &draft_data, draft_file_size)) {
+            return 1;
+        }
+        if (serve_mode || draft_config.vocab_size != config.vocab_size) {
+            printf("--draft needs a model with the same vocab, and a single sequence, not --serve\n");
+            return 1;
+        }
+    }
+    if (prefault_weights) {
+        prefault(data, file_size);
+        if (draft_checkpoint) { prefault(draft_data, draft_file_size); }
+    }
+    // loading is reported on its own, the first token would otherwise hide the page faults
+    fprintf(stderr, "loaded %s (%ld MB) in %ld ms\n", checkpoint, file_size >> 20, time_in_ms() - load_start);
+    if ((quantized || kv_dtype != DTYPE_FP32) && training_data) {
+        printf("Fine-tuning needs an fp32 checkpoint and kv cache, int8 and 16-bit ones can't be differentiated\n");
+        return 1;
     }
+    if (check) {
+        // fails on more than rounding differences, the two sum in different orders
+        if (quantized) { printf("--check-forward needs an fp32 checkpoint, the fine-tuning pass has no other\n"); return 1; }
+        int n = steps > 0 && steps < config.seq_len ? steps : config.seq_len;
+        float diff = check_forward(&config, &weights, n, rng_seed);
+        printf("max logit difference between the forward passes over %d positions: %g\n", n, diff);
+        return diff <= 1e-3f ? 0 : 1;
+    }
+    // low-rank adapters, merged into the weights right away unless they are fine-tuned further
+    LoraWeights lora;
+    malloc_lora(&lora, &config, 0, 0.0f, 0, NULL);
+    if (lora_path && read_lora(lora_path, &lora, &config)) { return 1; }
+    if (lora_path && !training_data) {
+        merge_lora(&lora, &config, &weights, quantized ? &qweights : NULL);
+        free_lora(&lora, &config);
+    } else if (lora_training && !lora_path) {
+        uint64_t lora_rng = rng_state; // a copy, so the sampling after fine-tuning doesn't depend on it
+        malloc_lora(&lora, &config, lora_rank, lora_alpha > 0.0f ? lora_alpha : lora_rank, lora_ffn, &lora_rng);
+    }
+    // kv cache snapshots are only valid for the exact weights in the checkpoint file
+    SnapshotHeader snapshot;
+    if (kv_cache_dir) {
+        struct stat st;
+        if (training_data || lora_path || serve_mode || stat(checkpoint, &st) != 0) {
+            printf("--kv-cache needs an unmodified checkpoint and a single sequence, not fine-tuning, --lora or --serve\n");
+            return 1;
+        }
+        memset(&snapshot, 0, sizeof(snapshot));
+        snapshot.magic = SNAPSHOT_MAGIC;
+        snapshot.version = 2;
+        snapshot.model_size = st.st_size;
+        snapshot.model_mtime = st.st_mtime;
+        snapshot.config = config;
+        snapshot.kv_block = KV_BLOCK;
+        snapshot.dtype = quantized ? qweights.dtype : DTYPE_FP32;
+        snapshot.kv_dtype = kv_dtype;
+    }
+    if (ring && (training_data || serve_mode || draft_checkpoint || kv_cache_dir
+                 || n_sink + MAX_CHUNK > config.seq_len)) {
+        printf("--ring is for a single sequence, not fine-tuning, --serve, --draft or --kv-cache,\n"
+               "and needs a seq_len of at least --sinks + %d\n", MAX_CHUNK);
+        return 1;
+    }
+    // we cannot run for more than config.seq_len steps, which --ctx can raise, unless the kv cache is a ring
+    if (steps <= 0 || (steps > config.seq_len && !ring)) { steps = config.seq_len; }
+    if (draft_checkpoint && steps > draft_config.seq_len) { steps = draft_config.seq_len; }
 
-    // free_run_state(&state);
-    // malloc_run_state(&state, &config);
+    // read in the tokenizer.bin file
+    char** vocab = (char**)malloc(config.vocab_size * sizeof(char*));
+    {
+        FILE *file = fopen("tokenizer.bin", "rb");
+        if (!file) {
+            printf("Unable to open the tokenizer file tokenizer.bin! Run "
+            "python tokenizer.py to convert tokenizer.model -> tokenizer.bin\n");
+            return 1;
+        }
+        int len;
+        for (int i = 0; i < config.vocab_size; i++) {
+            if(fread(&len, sizeof(int), 1, file) != 1) { return 1; }
+            vocab[i] = (char *)malloc(len + 1);
+            if(fread(vocab[i], len, 1, file) != 1) { return 1; }
+            vocab[i][len] = '\0'; // add the string terminating token
+        }
+        fclose(file);
+    }
+    VocabTrie trie;
+    build_vocab_trie(&trie, vocab, config.vocab_size);
 
-    // while (pos < steps) {
+    // create and init the application RunState
+    RunState state;
+    if (serve_mode && kv_blocks <= 0) { kv_blocks = batch * ((config.seq_len + KV_BLOCK - 1) / KV_BLOCK); }
+    malloc_run_state(&state, &config, serve_mode ? batch : 1, serve_mode ? kv_blocks : 0, kv_dtype);
+    if (ring) { init_kv_ring(&state, &config, n_sink, train_len, rope_scaling); }
+    RunState draft_state;
+    if (draft_checkpoint) { malloc_run_state(&draft_state, &draft_config, 1, 0, kv_dtype); }
+    Sampler sampler;
+    malloc_sampler(&sampler, config.vocab_size, temperature, topk, topp);
 
-    //     // forward the transformer to get logits for the next token
-    //     transformer(token, pos, &config, &state, &weights);
-    //     // sample the next token
-    //     if(temperature == 0.0f) {
-    //         // greedy argmax sampling
-    //         next = argmax(state.logits, config.vocab_size);
-    //     } else {
-    //         // apply the temperature to the logits
-    //         for (int q=0; q<config.vocab_size; q++) { state.logits[q] /= temperature; }
-    //         // apply softmax to the logits to get the probabilities for next token
-    //         softmax(state.logits, config.vocab_size);
-    //         // we now want to sample from this distribution to get the next token
-    //         next = sample(state.logits, config.vocab_size);
-    //     }
-    //     // printf("%d\n", next);
-    //     printf("%s", vocab[next]);
-    //     fflush(stdout);
+    // the current position we are in
+    long start = time_in_ms();
+    int next;
+    int token = 1; // 1 = BOS token in Llama-2 sentencepiece
+    int pos = 0;
+    if (!serve_mode && !bench_mode) { printf("<s>\n"); } // explicit print the initial BOS token (=1), stylistically symmetric
 
-    //     token = next;
-    //     pos++;
+    if(training_data){
 
-    // }
+        // map the training data, its tokens are streamed in as the loop needs them
+        TokenStream train;
+        if (open_token_stream(&train, training_data, &trie, config.vocab_size) != 0) { return 1; }
 
-    while (pos < steps) {
+        if (tokenize_only) {
+            // tokenize the whole source, regardless of steps, so the tokenizer can be timed on its own
+            long tok_start = time_in_ms();
+            long n_tokens = 0;
+            start_token_stream(&train, 0, train.length);
+            int* tokens = malloc(STREAM_BATCH * sizeof(int));
+            if (!tokens) { printf("malloc failed!\n"); exit(1); }
+            for (int n; (n = stream_read(&train, tokens, STREAM_BATCH)) > 0; ) { n_tokens += n; }
+            long tok_end = time_in_ms();
+            printf("tokenized %ld %s into %ld tokens in %ld ms\n", train.length, train.pretokenized ? "pretokenized ids" : "bytes",
+                   n_tokens, tok_end - tok_start);
+            free(tokens);
+            close_token_stream(&train);
+            free_lora(&lora, &config);
+            free_vocab_trie(&trie);
+            for (int i = 0; i < config.vocab_size; i++) { free(vocab[i]); }
+            free(vocab);
+            return 0;
+        }
 
-        // forward the transformer to get logits for the next token
-        transformer(token, pos, &config, &state, &weights);
-        // sample the next token
-        if(temperature == 0.0f) {
-            // greedy argmax sampling
-            next = argmax(state.logits, config.vocab_size);
+        // with adapters only they are trainable, and the weights are left constant for Enzyme
+        Gradients grads;
+        LoraWeights dlora = { 0 };
+        if (lora_training) {
+            malloc_lora_gradients(&grads, &dlora, &lora, &config);
         } else {
-            // apply the temperature to the logits
-            for (int q=0; q<config.vocab_size; q++) { state.logits[q] /= temperature; }
-            // apply softmax to the logits to get the probabilities for next token
-            softmax(state.logits, config.vocab_size);
-            // we now want to sample from this distribution to get the next token
-            next = sample(state.logits, config.vocab_size);
-        }
-        // printf("%d\n", next);
-        printf("%s", vocab[next]);
-        fflush(stdout);
-        token = next;
-        pos++;
+            malloc_gradients(&grads, &dweights, &weights, &config, shared_weights, freeze_embeddings, freeze_layers);
+        }
+        // a step only looks up one embedding row, so with an unshared classifier the rest
+        // of token_embedding_table gets no gradient. when wcls is the same table every row does
+        RowTracker emb_rows;
+        // (with --workers the ranks' dirty rows differ, so the whole table is reduced and stepped)
+        int track_rows = !lora_training && !shared_weights && !freeze_embeddings && n_workers == 1;
+        if (track_rows) {
+            malloc_row_tracker(&emb_rows, config.vocab_size, config.dim);
+            grads.params[0].rows = &emb_rows; // the embeddings are always the first param
+        }
+        malloc_optimizer(&opt, grads.params, grads.n_params);
+        // the shadow of the RunState, that Enzyme propagates the loss back through
+        RunState dstate;
+        malloc_run_state(&dstate, &config, 1, 0, DTYPE_FP32);
+        int n_accum = 0; // tokens whose gradient is sitting in dweights, not yet applied
+        // the window of positions differentiated together: its inputs, then the last target
+        int* seq = malloc((train_seq + 1) * sizeof(int));
+        float* losses = malloc(train_seq * sizeof(float));
+        float* dlosses = calloc(train_seq, sizeof(float)); // never seeded, losses is only an output
+        if (!seq || !losses || !dlosses) { printf("malloc failed!\n"); exit(1); }
+        // with --recompute, the input of every layer for a window, and the adjoint passed down them
+        float* layer_x = NULL;
+        float* layer_dx = NULL;
+        if (recompute) {
+            layer_x = malloc((size_t)(config.n_layers + 1) * train_seq * config.dim * sizeof(float));
+            layer_dx = malloc((size_t)train_seq * config.dim * sizeof(float));
+            if (!layer_x || !layer_dx) { printf("malloc failed!\n"); exit(1); }
+        }
+
+        // --workers N: fork the other ranks, each one trains on its own slice of the text
+        DataParallel dp = { .n_ranks = 1, .rank = 0 };
+        pid_t worker_pids[MAX_RANKS];
+        if (n_workers > 1) {
+            if (pool.n_threads > 1) { printf("the thread pool doesn't survive forking the ranks\n"); exit(1); }
+            init_data_parallel(&dp, n_workers, reduce_bf16);
+            fflush(stdout); // or the children print it again
+            for (int r = 1; r < n_workers; r++) {
+                pid_t pid = fork();
+                if (pid == 0) { dp.rank = r; break; }
+                if (pid == -1) {
+                    // the ones already forked would wait for it forever
+                    printf("fork failed!\n");
+                    for (int k = 1; k < r; k++) { kill(worker_pids[k], SIGKILL); }
+                    exit(1);
+                }
+                worker_pids[r] = pid;
+            }
+        }
+        // the tokenizing thread is started only now, a fork would leave it behind
+        start_token_stream(&train, train.length * dp.rank / dp.n_ranks, train.length * (dp.rank + 1) / dp.n_ranks);
+
+        // an optimizer step every windows_per_step windows, the first that add up to --grad-accum
+        // tokens. all ranks step together, the ones out of data just have nothing to add
+        int windows_per_step = (grad_accum + train_seq - 1) / train_seq;
+        int n_windows = 0;
+        long n_trained = 0, profiled_tokens = 0; // --bench times the windows after --bench-warmup
+        for (;;) {
+            if (pos < steps && stream_more(&train)) {
+                // the next train_seq tokens are the targets, each input is the token before it
+                seq[0] = token;
+                int nt = stream_read(&train, &seq[1], train_seq < steps - pos ? train_seq : steps - pos);
+                if (n_trained++ == bench_warmup) { profile_reset(); profiled_tokens = 0; }
+                profiled_tokens += nt;
+                if (profile.on) {
+                    // the forward pass on its own, the one Enzyme runs below is timed with the backward pass
+                    profile_start();
+                    sequence_loss(seq, nt, pos, &config, &state, &weights, &lora, losses, temperature);
+                    profile_mark(0, OP_TRAIN_FORWARD);
+                }
+
+                if (recompute) {
+                    checkpointed_step(seq, nt, pos, &config, &state, &dstate, &weights, lora_training ? NULL : &dweights,
+                                      &lora, &dlora, layer_x, layer_dx, losses, dlosses,
+                                      !lora_training && freeze_embeddings ? freeze_layers : 0, temperature);
+                } else if (lora_training) {
+                    __enzyme_autodiff_lora((void*)sequence_loss,
+                                        enzyme_primal_return,
+                                        enzyme_const, seq,
+                                        enzyme_const, nt,
+                                        enzyme_const, pos,
+                                        enzyme_const, &config,
+                                        enzyme_dup, &state, &dstate,
+                                        enzyme_const, &weights,
+                                        enzyme_dup, &lora, &dlora,
+                                        enzyme_dup, losses, dlosses,
+                                        enzyme_const, temperature);
+                } else {
+                    __enzyme_autodiff((void*)sequence_loss,
+                                        enzyme_primal_return,
+                                        enzyme_const, seq,
+                                        enzyme_const, nt,
+                                        enzyme_const, pos,
+                                        enzyme_const, &config,
+                                        enzyme_dup, &state, &dstate, 
+                                        enzyme_dup, &weights , &dweights,
+                                        enzyme_const, &lora,
+                                        enzyme_dup, losses, dlosses,
+                                        enzyme_const, temperature);
+                }
+                profile_mark(0, OP_TRAIN_BACKWARD);
 
+                if (dp.rank == 0) {
+                    for (int t = 0; t < nt; t++) { printf("%s %d %f\n", vocab[seq[t + 1]], pos + t, losses[t]); }
+                    fflush(stdout);
+                }
+
+                // Enzyme adds into dweights, so gradients accumulate across calls until applied
+                n_accum += nt;
+                if (track_rows) { for (int t = 0; t < nt; t++) { row_mark(&emb_rows, seq[t]); } }
+                // the shadow kv cache is not cleared: its pages start out zero, and positions only
+                // move forward. a window's backward pass consumes (and clears) only the adjoints
+                // of the positions it stores itself, which no earlier window attended to. what it
+                // adds to earlier positions is left behind and never read again
+                zero_activations(&dstate, &config);
+
+                token = seq[nt];
+                pos += nt;
+            }
+            if (++n_windows < windows_per_step) { continue; }
+            n_windows = 0;
+            long n_tokens = n_accum;
+            int more = pos < steps && stream_more(&train);
+            profile_start();
+            double ss = dp.n_ranks > 1 ? allreduce_gradients(&dp, grads.params, grads.n_params, &n_tokens, &more)
+                                       : grad_norm_sq(grads.params, grads.n_params);
+            profile_mark(0, OP_TRAIN_REDUCE);
+            if (n_tokens > 0) { optimizer_step(&opt, grads.params, grads.n_params, n_tokens, ss); }
+            profile_mark(0, OP_TRAIN_UPDATE);
+            n_accum = 0;
+            if (!more) { break; }
+        }
+        close_token_stream(&train);
+        long n_profiled = n_trained - bench_warmup;
+        if (profile.on && dp.rank == 0 && n_profiled > 0) {
+            // flops of the matmuls, 2 per weight per token forward, Enzyme's call runs the forward
+            // again and twice that backward. the update reads weights and gradients, writes the weights
+            double n_matmul = (double)config.n_layers * config.dim * (2.0 * config.dim + 2.0 * (config.dim * config.n_kv_heads
+                              / config.n_heads) + 3.0 * config.hidden_dim) + (double)config.vocab_size * config.dim;
+            double n_values = 0;
+            for (int i = 0; i < grads.n_params; i++) { n_values += grads.params[i].n; }
+            profile.flops[OP_TRAIN_FORWARD] = 2 * n_matmul * profiled_tokens;
+            profile.flops[OP_TRAIN_BACKWARD] = 6 * n_matmul * profiled_tokens;
+            profile.bytes[OP_TRAIN_REDUCE] = n_values * sizeof(float) * (dp.n_ranks > 1 ? 2 : 1);
+            profile.bytes[OP_TRAIN_UPDATE] = n_values * sizeof(float) * 3;
+            long total = 0;
+            for (int i = OP_TRAIN_FORWARD; i < N_OPS; i++) { total += profile.ns[i]; }
+            double rate = total > 0 ? profiled_tokens / (total / 1e9) : 0.0;
+            fprintf(stderr, "fine-tuned %ld tokens in %ld windows at %.2f tok/s, after %d warmup windows\n",
+                    profiled_tokens, n_profiled, rate, bench_warmup);
+            printf("{\"bench\": \"train\", \"model\": \"%s\", \"workers\": %d, \"train_seq\": %d, \"recompute\": %d, "
+                   "\"lora\": %d, \"warmup\": %d, \"windows\": %ld, \"tokens\": %ld, \"tok_s\": %.3f, ",
+                   checkpoint, dp.n_ranks, train_seq, recompute, lora_training, bench_warmup, n_profiled, profiled_tokens, rate);
+            profile_report(OP_TRAIN_FORWARD, N_OPS, n_profiled, "per window");
+            printf("}\n");
+            fflush(stdout);
+        }
+        if (dp.rank > 0) { _exit(0); } // rank 0 carries on with the trained weights
+        for (int r = 1; r < dp.n_ranks; r++) {
+            int status;
+            if (waitpid(worker_pids[r], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                printf("fine-tuning worker %d failed\n", r);
+                return 1;
+            }
+        }
+        if (dp.n_ranks > 1) { free_data_parallel(&dp); }
+        free(seq);
+        free(losses);
+        free(dlosses);
+        free(layer_x);
+        free(layer_dx);
+        free_run_state(&dstate);
+        free_optimizer(&opt);
+        if (track_rows) { free_row_tracker(&emb_rows); }
+        free_gradients(&grads);
+
+        printf("\n\nFinished fine-tuning.\n\n");
+        if (lora_training) {
+            if (lora_out && write_lora(lora_out, &lora, &config)) { return 1; }
+            // generate with the adapters merged in, on a private copy of the pages they change
+            if (remap_writable(data, file_size, fd)) { return 1; }
+            merge_lora(&lora, &config, &weights, NULL);
+            free_lora(&lora, &config);
+        }
+
+        pos = 0;
+        zero_run_state(&state, &config);
+        token = 1;
+        if (!serve_mode && !bench_mode) { printf("<s>\n"); } // explicit print the initial BOS token (=1), stylistically symmetric
+        start = time_in_ms(); // tok/s is for the generation alone
     }
 
+    if (bench_mode) {
+        bench(&config, &state, &weights, quantized ? &qweights : NULL, &trie, &sampler, rng_seed, prompt, steps,
+              bench_warmup, bench_repeat, checkpoint);
+    } else if (serve_mode) {
+        serve(&config, &state, &weights, quantized ? &qweights : NULL, vocab, &trie, &sampler, rng_seed, steps);
+    } else {
+        // the tokens of the sequence: BOS, the prompt, and with --draft the generated ones. with
+        // --ring steps has no bound, but the prompt takes at most one token per byte
+        long max_tokens = steps + 1;
+        long prompt_bytes = (prompt ? strlen(prompt) : 0) + (system_prompt ? strlen(system_prompt) : 0);
+        if (ring && prompt_bytes + 1 < max_tokens) { max_tokens = prompt_bytes + 1; }
+        int* tokens = malloc(max_tokens * sizeof(int));
+        if (!tokens) { printf("malloc failed!\n"); return 1; }
+        tokens[0] = token;
+        if (prompt || system_prompt) {
+            // greedily tokenize the system prompt and the prompt with the vocab, after the BOS token
+            int n_prompt = 1;
+            int n_system = 1;
+            char* texts[2] = { system_prompt, prompt };
+            for (int k = 0; k < 2; k++) {
+                long len = texts[k] ? strlen(texts[k]) : 0;
+                n_prompt += tokenize(&trie, texts[k], len, &tokens[n_prompt], steps - n_prompt, NULL);
+                if (k == 0) { n_system = n_prompt; }
+            }
+            // the prefix whose kv cache is snapshotted: BOS and the system prompt if there is one,
+            // else every prompt token that is prefilled
+            int n_prefix = system_prompt && n_system < n_prompt ? n_system : n_prompt - 1;
+            int restored = 0;
+            if (kv_cache_dir && n_prefix > 0) {
+                restored = restore_run_state(&state, kv_cache_dir, &snapshot, tokens, n_prefix);
+                if (restored) { pos = n_prefix; }
+            }
+            // prefill the kv cache with all but the last prompt token, MAX_CHUNK tokens per
+            // forward pass. the last one is forwarded below and gives the first sampled token
+            while (pos < n_prompt - 1) {
+                // stop at the end of the prefix to snapshot it
+                int end = pos < n_prefix ? n_prefix : n_prompt - 1;
+                int nt = end - pos < MAX_CHUNK ? end - pos : MAX_CHUNK;
+                forward_chunk(tokens + pos, nt, pos, &config, &state, &weights, quantized ? &qweights : NULL);
+                pos += nt;
+                if (kv_cache_dir && pos == n_prefix
+                    && !save_run_state(&state, kv_cache_dir, &snapshot, tokens, n_prefix)) {
+                    fprintf(stderr, "could not save the kv cache snapshot into %s\n", kv_cache_dir);
+                }
+            }
+            for (int i = 1; i < n_prompt; i++) { printf("%s", vocab[tokens[i]]); }
+            fflush(stdout);
+            token = tokens[n_prompt - 1];
+        }
+
+        long n_drafted = 0, n_accepted = 0;
+        if (draft_checkpoint) {
+            speculate(&config, &state, &weights, quantized ? &qweights : NULL,
+                      &draft_config, &draft_state, &draft_weights, draft_quantized ? &draft_qweights : NULL,
+                      &sampler, &rng_state, vocab, tokens, pos, steps, draft_k, &n_drafted, &n_accepted);
+            pos = steps;
+        }
+        while (pos < steps) {
 
+            // forward the transformer to get logits for the next token
+            forward_chunk(&token, 1, pos, &config, &state, &weights, quantized ? &qweights : NULL);
+            // sample the next token
+            next = sample_logits(&sampler, state.logits, &rng_state);
+            // printf("%d\n", next);
+            printf("%s", vocab[next]);
+            fflush(stdout);
+            token = next;
+            pos++;
+        }
 
-    // report achieved tok/s
-    long end = time_in_ms();
-    printf("\nachieved tok/s: %f\n", steps / (double)(end-start)*1000);
+        // report achieved tok/s
+        long end = time_in_ms();
+        printf("\nachieved tok/s: %f\n", steps / (double)(end-start)*1000);
+        if (draft_checkpoint) {
+            printf("accepted %ld of %ld draft tokens (%.1f%%)\n", n_accepted, n_drafted,
+                   n_drafted ? 100.0 * n_accepted / n_drafted : 0.0);
+        }
+        free(tokens);
+    }
 
     // memory and file handles cleanup
+    free_pool();
     free_run_state(&state);
+    free_sampler(&sampler);
+    free_vocab_trie(&trie);
+    free_weights(&weights, &qweights, quantized);
     for (int i = 0; i < config.vocab_size; i++) { free(vocab[i]); }
     free(vocab);
     if (data != MAP_FAILED) munmap(data, file_size);
     if (fd != -1) close(fd);
+    if (draft_checkpoint) {
+        free_run_state(&draft_state);
+        free_weights(&draft_weights, &draft_qweights, draft_quantized);
+        munmap(draft_data, draft_file_size);
+        close(draft_fd);
+    }
     return 0;
 }
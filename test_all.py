@@ -51,3 +51,59 @@ def test_argmax_inference():
 
     # compare
     assert c_tokens == pt_tokens
+
+def export_tiny_model(path, **kwargs):
+    """a tiny random model, exported for ./run with model.export(path, **kwargs)"""
+    torch.manual_seed(42)
+    args = ModelArgs(dim=64, n_layers=2, n_heads=4, n_kv_heads=2, vocab_size=32000,
+                     multiple_of=32, max_seq_len=64)
+    model = Transformer(args)
+    model.eval()
+    model.export(str(path), **kwargs)
+    return model
+
+def test_forward_passes_agree(tmp_path):
+    """
+    run.c has two forward passes: the one inference runs on its thread pool, and the one
+    fine-tuning differentiates with Enzyme. --check-forward pushes the same random tokens
+    through both and fails unless their logits agree
+    """
+    model_path = tmp_path / "model.bin"
+    export_tiny_model(model_path)
+    proc = subprocess.run(["./run", str(model_path), "0.0", "0", "--check-forward"],
+                          stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    assert proc.returncode == 0, proc.stdout.decode('utf-8')
+
+def generate_text(model_path, steps=16):
+    """greedy ./run output of model_path, without the tok/s report"""
+    proc = subprocess.run(["./run", str(model_path), "0.0", str(steps)],
+                          stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    assert proc.returncode == 0, proc.stderr.decode('utf-8')
+    lines = proc.stdout.decode('utf-8').splitlines()
+    return "\n".join(line for line in lines if not line.startswith("achieved tok/s"))
+
+def test_exported_dtypes(tmp_path):
+    """
+    export the same tiny model with export, export_q80 and export_half, and see that ./run
+    loads each of them. fp16 keeps enough of the weights that greedy sampling at temperature 0
+    picks the same tokens as fp32; int8 and bf16 may drift, so of those only the loading is checked
+    """
+    fp32_path = tmp_path / "model.bin"
+    model = export_tiny_model(fp32_path)
+    paths = {
+        'q80': tmp_path / "model_q80.bin",
+        'fp16': tmp_path / "model_fp16.bin",
+        'bf16': tmp_path / "model_bf16.bin",
+    }
+    model.export_q80(str(paths['q80']))
+    model.export_half(str(paths['fp16']), half='fp16')
+    model.export_half(str(paths['bf16']), half='bf16')
+
+    fp32_text = generate_text(fp32_path)
+    assert fp32_text
+    for name, path in paths.items():
+        assert os.path.getsize(path) < os.path.getsize(fp32_path), name
+        text = generate_text(path)
+        assert text, name
+        if name == 'fp16':
+            assert text == fp32_text
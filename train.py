@@ -39,6 +39,8 @@ eval_iters = 100
 eval_only = False  # if True, script exits right after the first eval
 always_save_checkpoint = False  # if True, always save a checkpoint after each eval
 init_from = "scratch"  # 'scratch' or 'resume'
+export_q80 = False  # if True, also export an int8 quantized model_q80.bin next to model.bin
+export_half = ""  # 'fp16' or 'bf16' to also export a 16-bit model_fp16.bin or model_bf16.bin
 # wandb logging
 wandb_log = False  # disabled by default
 wandb_project = "llamac"
@@ -278,6 +280,10 @@ while True:
                 print(f"saving checkpoint to {out_dir}")
                 torch.save(checkpoint, os.path.join(out_dir, "ckpt.pt"))
                 raw_model.export(os.path.join(out_dir, "model.bin"))
+                if export_q80:
+                    raw_model.export_q80(os.path.join(out_dir, "model_q80.bin"))
+                if export_half:
+                    raw_model.export_half(os.path.join(out_dir, f"model_{export_half}.bin"), export_half)
     if iter_num == 0 and eval_only:
         break
 